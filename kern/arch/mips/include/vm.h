@@ -30,6 +30,8 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <mips/tlb.h>
+
 
 /*
  * Machine-dependent VM system definitions.
@@ -125,5 +127,21 @@ struct tlbshootdown {
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-cpu TLB bookkeeping, kept in struct cpu: the ASID loaded in
+ * c0_entryhi, and a stack of TLB slots known to be empty so a refill
+ * doesn't have to search for one. Slots go back on the stack when a
+ * full flush or an ASID retirement invalidates their entries.
+ */
+
+struct cpu_tlb {
+	unsigned ct_asid;
+	unsigned ct_nfree;
+	uint8_t ct_free[NUM_TLB];
+};
+
+/* Set up the bookkeeping for a cpu whose TLB has just been reset. */
+void cpu_tlb_init(struct cpu_tlb *ct);
+
 
 #endif /* _MIPS_VM_H_ */
@@ -34,6 +34,7 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 /*
  * System call dispatcher.
  *
@@ -99,6 +100,10 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 			(userptr_t)tf->tf_a1);
 		break;
+		case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1);
+		break;
 #ifdef UW
 		case SYS_write:
 		err = sys_write((int)tf->tf_a0,
@@ -130,6 +135,11 @@ syscall(struct trapframe *tf)
 		case SYS_execv:
 		err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 		break;
+#endif
+#if OPT_A3
+		case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
 #endif
 		default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -29,14 +29,23 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <thread.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <stat.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
 #include "opt-A3.h"
 
 /*
@@ -48,15 +57,68 @@
 #define DUMBVM_STACKPAGES    12
 
 #if OPT_A3
+/*
+ * The user stack starts out one page long and grows down on demand,
+ * to at most DUMBVM_STACKLIMIT bytes (the stack rlimit). One unmapped
+ * guard page is always kept between the stack and the region below
+ * it, so a runaway stack faults instead of running into the heap.
+ */
+#define DUMBVM_STACKLIMIT    (1024 * 1024)
+#endif
+
+#if OPT_A3
+/*
+ * User page tables have two levels. A user address splits into a
+ * page directory index, a page table index and the page offset;
+ * each second-level table fills exactly one page.
+ */
+#define PT_NENT		(PAGE_SIZE / sizeof(paddr_t))
+#define PT_NDIR		(USERSPACETOP / (PT_NENT * PAGE_SIZE))
+#define PT_DIR(va)	((va) / (PT_NENT * PAGE_SIZE))
+#define PT_ENT(va)	(((va) / PAGE_SIZE) % PT_NENT)
+#endif
+
+#if OPT_A3
+/*
+ * Physical memory is handed out by a binary buddy allocator layered
+ * on the core map. Every block is 2^order frames long and starts at a
+ * frame index that is a multiple of 2^order (counted from cm_base), so
+ * a frame's index and its buddy's index are simple arithmetic on the
+ * physical address and no search is ever needed.
+ *
+ * Free blocks of each order are kept on a doubly linked list threaded
+ * through the core map entries of their head frames.
+ */
+
+/* largest block is 2^CM_MAXORDER pages (16M with 4k pages) */
+#define CM_MAXORDER	12
+/* list terminator for the free lists */
+#define CM_NONE		(-1)
+
 struct CoreMap {
-	/* keep track of where this contiguous block starts */
-	paddr_t start_addr;
-	/* indicate how many contiguous block allocated */
-	int total_block;
-	/* what number is this frame in the allocated contiguous block */
-	int block_num;
-	/* keep track if each frame is used or not */
+	/* true if this frame is the first frame of a block */
+	bool head;
+	/* keep track if the block this frame heads is used or not */
 	bool use;
+	/* log2 of the block size; only meaningful on block heads */
+	int order;
+	/* pages the caller actually asked for (allocated heads only) */
+	int npages;
+	/* free list links (core map indices); only on free block heads */
+	int next;
+	int prev;
+	/* address spaces sharing this frame copy-on-write (user pages) */
+	int refcount;
+	/*
+	 * Reverse map for the pager: the address space and page that
+	 * map this frame, if exactly one does. NULL for kernel memory
+	 * and shared frames, which are never evicted. Protected by
+	 * cm_ref_lock, like refcount.
+	 */
+	struct addrspace *owner;
+	vaddr_t vaddr;
+	/* set when the page is mapped, cleared by the clock hand */
+	bool referenced;
 };
 #endif
 
@@ -68,159 +130,1621 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 #if OPT_A3
 struct CoreMap *core_map;
 int total_frames = 0;
-#endif
+/* physical address of core map frame 0 */
+static paddr_t cm_base;
+
+/* per-order free lists, protected by stealmem_lock */
+static int cm_freelist[CM_MAXORDER+1];
+/* per-order occupancy, for the kh menu command */
+static unsigned cm_nfree[CM_MAXORDER+1];
+static unsigned cm_nused[CM_MAXORDER+1];
+/* frames on the free lists, summed over all orders */
+static unsigned cm_nfreepages;
+/* pages handed out vs. pages asked for (internal fragmentation) */
+static unsigned cm_pages_alloc;
+static unsigned cm_pages_req;
+
+/* protects the refcount field of every core map entry */
+static struct spinlock cm_ref_lock = SPINLOCK_INITIALIZER;
+/* frames shared by fork, copied on write, and reclaimed by the last sharer */
+static unsigned cm_cow_shares;
+static unsigned cm_cow_copies;
+static unsigned cm_cow_reuses;
+
+/* core map index <-> physical address */
+static
+int
+cm_index(paddr_t pa)
+{
+	return (pa - cm_base) / PAGE_SIZE;
+}
 
-void
-vm_bootstrap(void)
+static
+paddr_t
+cm_paddr(int i)
 {
-	/* Do nothing. */
-	#if OPT_A3
-	/* call ram_getsize to get the remaining physical memory in the system */
-	paddr_t lo, hi;
-	ram_getsize(&lo, &hi);
-//	kprintf("lo = %u, hi = %u\n", lo, hi);
+	return cm_base + (paddr_t)i * PAGE_SIZE;
+}
 
-	/* Logically partition the memory into fixed size frames. 
-	Each frame is PAGE_SIZE bytes.
-	*/
-	int num_of_frames = (hi - lo)/PAGE_SIZE; 
-//	kprintf("num_of_frames = %d\n", num_of_frames);
+/* smallest order whose block holds npages */
+static
+int
+cm_order(unsigned long npages)
+{
+	int order = 0;
 
-	/* Store core map in the start of the memory returned by ram_getsize. */
-	core_map = (struct CoreMap *)PADDR_TO_KVADDR(lo);
+	while (((unsigned long)1 << order) < npages) {
+		++order;
+	}
+	return order;
+}
 
-	/* find total memories that core map can use */
-	lo += num_of_frames * sizeof(struct CoreMap);
-//	kprintf("lo before round up = %u\n", lo);
-	lo = ROUNDUP(lo, PAGE_SIZE);
-	kprintf("lo after round up = %u\n", lo);
+static
+void
+cm_push(int i, int order)
+{
+	core_map[i].head = true;
+	core_map[i].use = false;
+	core_map[i].order = order;
+	core_map[i].npages = 0;
+	core_map[i].prev = CM_NONE;
+	core_map[i].next = cm_freelist[order];
+	if (cm_freelist[order] != CM_NONE) {
+		core_map[cm_freelist[order]].prev = i;
+	}
+	cm_freelist[order] = i;
+	cm_nfree[order]++;
+	cm_nfreepages += 1 << order;
+}
 
-	/* calculate real num of frames after set up core map */
-	num_of_frames = (hi - lo)/PAGE_SIZE;
-	total_frames = num_of_frames;
-//	kprintf("total_frames = %d", total_frames);
+static
+void
+cm_unlink(int i)
+{
+	int order = core_map[i].order;
 
-	/* set up core map*/
-	paddr_t temp_lo = lo;
-	for (int i=0; i<num_of_frames; ++i) {
-		core_map[i].start_addr = temp_lo;
-		temp_lo += PAGE_SIZE;
-		core_map[i].block_num = 1;
-		core_map[i].total_block = 1;
-		core_map[i].use = false;
+	KASSERT(core_map[i].head && !core_map[i].use);
+	if (core_map[i].prev != CM_NONE) {
+		core_map[core_map[i].prev].next = core_map[i].next;
+	} else {
+		cm_freelist[order] = core_map[i].next;
 	}
-	#endif
+	if (core_map[i].next != CM_NONE) {
+		core_map[core_map[i].next].prev = core_map[i].prev;
+	}
+	core_map[i].next = core_map[i].prev = CM_NONE;
+	KASSERT(cm_nfree[order] > 0);
+	cm_nfree[order]--;
+	cm_nfreepages -= 1 << order;
 }
 
+/*
+ * Take a block of at least npages frames off the free lists, splitting
+ * a larger block if that's all there is. Returns 0 if nothing fits.
+ * Caller holds stealmem_lock.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+cm_alloc(unsigned long npages)
 {
-	paddr_t addr;
-	/* find_block = true if we find a contiguous block */
-	bool find_block = false;
+	int want, order, i;
 
-	spinlock_acquire(&stealmem_lock);
+	want = cm_order(npages);
+	if (want > CM_MAXORDER) {
+		return 0;
+	}
 
-	#if OPT_A3
-	if (total_frames == 0) {
-		addr = ram_stealmem(npages);
-	} else {
-		// i = index of core map, page suppose to = npages
-		int i, page = 0; 
-		for (i=0; i<total_frames; ++i) {
-			if (!core_map[i].use) {
-				++page;
-				if (page == (int)npages) {
-				find_block = true;
-				break;
-				}
-			} else {
-				page = 0;
-			}
-		} 
-		if (find_block) {
-			int count_block_number=1;
-			for (int j=i-(int)npages+1; j<=i; ++j) {
-				if (j == i-(int)npages+1) {
-					addr = core_map[j].start_addr;
-				}
-				core_map[j].use = true;
-				core_map[j].total_block = npages;
-				core_map[j].block_num = count_block_number;
-				++count_block_number;
-			}
+	for (order = want; order <= CM_MAXORDER; ++order) {
+		if (cm_freelist[order] != CM_NONE) {
+			break;
+		}
+	}
+	if (order > CM_MAXORDER) {
+		/* not enough contiguous frames for npages */
+		return 0;
+	}
+
+	i = cm_freelist[order];
+	cm_unlink(i);
+
+	/* give back the upper halves until the block is the right size */
+	while (order > want) {
+		--order;
+		cm_push(i + (1 << order), order);
+	}
+
+	core_map[i].head = true;
+	core_map[i].use = true;
+	core_map[i].order = want;
+	core_map[i].npages = npages;
+	cm_nused[want]++;
+	cm_pages_alloc += 1 << want;
+	cm_pages_req += npages;
+
+	return cm_paddr(i);
+}
+
+/*
+ * Return the block starting at paddr, merging it with its buddy for as
+ * long as the buddy is also free. Caller holds stealmem_lock.
+ */
+static
+void
+cm_free(paddr_t paddr)
+{
+	int i, buddy, order;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	i = cm_index(paddr);
+	KASSERT(i >= 0 && i < total_frames);
+	KASSERT(core_map[i].head);
+	KASSERT(core_map[i].use);
+
+	order = core_map[i].order;
+	cm_nused[order]--;
+	cm_pages_alloc -= 1 << order;
+	cm_pages_req -= core_map[i].npages;
+
+	while (order < CM_MAXORDER) {
+		buddy = i ^ (1 << order);
+		if (buddy + (1 << order) > total_frames) {
+			break;
+		}
+		if (!core_map[buddy].head || core_map[buddy].use ||
+		    core_map[buddy].order != order) {
+			break;
+		}
+		cm_unlink(buddy);
+		/* the higher of the two stops being a block head */
+		if (buddy < i) {
+			core_map[i].head = false;
+			i = buddy;
 		} else {
-			/* not enough contigues blocks for npages */
-			spinlock_release(&stealmem_lock);
-			return 0;
+			core_map[buddy].head = false;
 		}
+		++order;
 	}
 
-	#else 
-	spinlock_acquire(&stealmem_lock);
-	addr = ram_stealmem(npages);
-	#endif
+	cm_push(i, order);
+}
 
-	spinlock_release(&stealmem_lock);
-	return addr;
+/*
+ * Address space IDs.
+ *
+ * User TLB entries carry the ASID of their address space in the PID
+ * field of TLBHI, so a context switch only loads the new ASID into
+ * c0_entryhi instead of flushing the TLB. ASIDs are handed out in
+ * generations: within one generation each ASID goes to at most one
+ * address space. When they run out a new generation starts, and each
+ * cpu flushes its TLB before it next loads an ASID, since the entries
+ * in it may carry ASIDs that are about to be reused.
+ *
+ * When some of an address space's entries have to go from every TLB
+ * (the pager took a page, fork made pages copy-on-write, sbrk shrank
+ * the heap), it gets a fresh ASID instead; nothing can match the old
+ * entries again, and the ones in this cpu's TLB are invalidated so
+ * their slots can be reused. ASID 0 is never handed out.
+ */
+#define TLBHI_ASID(asid)	((uint32_t)(asid) << TLBHI_PIDSHIFT)
+
+/* protects asid_gen, asid_next and every as_asid/as_asid_gen */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_gen = 1;
+static unsigned asid_next = 1;
+
+/*
+ * Load asid into c0_entryhi. tlb_probe is the only TLB operation that
+ * sets c0_entryhi and changes nothing else; its result is ignored.
+ */
+static
+void
+tlb_setasid(unsigned asid)
+{
+	(void)tlb_probe(TLBHI_ASID(asid), 0);
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/* tlb_reset leaves every entry invalid, so every slot is free */
+void
+cpu_tlb_init(struct cpu_tlb *ct)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	ct->ct_asid = 0;
+	ct->ct_nfree = NUM_TLB;
+	for (unsigned i=0; i<NUM_TLB; i++) {
+		ct->ct_free[i] = i;
+	}
+}
+
+/* invalidate the whole TLB of this cpu; call at splhigh */
+static
+void
+tlb_flush(void)
+{
+	struct cpu *c = curcpu->c_self;
+
+	for (unsigned i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		c->c_tlb.ct_free[i] = i;
+	}
+	c->c_tlb.ct_nfree = NUM_TLB;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Invalidate this cpu's entries tagged with asid, putting their slots
+ * back on the free stack, and reload the current ASID. Call at
+ * splhigh.
+ */
+static
+void
+tlb_purge(unsigned asid)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t ehi, elo;
+
+	for (unsigned i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) == 0 ||
+		    (ehi & TLBHI_PID) != TLBHI_ASID(asid)) {
+			continue;
+		}
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		KASSERT(c->c_tlb.ct_nfree < NUM_TLB);
+		c->c_tlb.ct_free[c->c_tlb.ct_nfree++] = i;
+	}
+	tlb_setasid(c->c_tlb.ct_asid);
+}
+
+/*
+ * Make as the address space seen by this cpu, giving it an ASID of
+ * the current generation if it doesn't have one. Call at splhigh.
+ */
+static
+void
+asid_load(struct addrspace *as)
+{
+	struct cpu *c = curcpu->c_self;
+	unsigned gen, asid;
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_gen != asid_gen) {
+		if (asid_next == NUM_ASID) {
+			asid_gen++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asid_gen = asid_gen;
+	}
+	gen = asid_gen;
+	asid = as->as_asid;
+	/* under asid_lock, for asid_retire_unloaded */
+	c->c_tlbas = as;
+	spinlock_release(&asid_lock);
+
+	if (c->c_asid_gen != gen) {
+		tlb_flush();
+		c->c_asid_gen = gen;
+	}
+	c->c_tlb.ct_asid = asid;
+	tlb_setasid(asid);
+}
+
+/*
+ * Finish retiring as, whose ASID was oldasid in generation oldgen:
+ * free the slots of its entries in this cpu's TLB, and give it a new
+ * ASID if it is loaded here. Entries in other cpus' TLBs stay until
+ * they are replaced or flushed; nothing can match them. Call at
+ * splhigh.
+ */
+static
+void
+asid_retired(struct addrspace *as, unsigned oldasid, unsigned oldgen)
+{
+	struct cpu *c = curcpu->c_self;
+
+	if (oldgen != 0 && oldgen == c->c_asid_gen) {
+		tlb_purge(oldasid);
+	}
+	if (c->c_tlbas == as) {
+		asid_load(as);
+	}
+}
+
+/*
+ * Make every TLB entry as has, on any cpu, unreachable by moving it
+ * to a fresh ASID. as must not be loaded on another cpu.
+ */
+static
+void
+asid_retire(struct addrspace *as)
+{
+	unsigned oldasid, oldgen;
+	int spl;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	oldasid = as->as_asid;
+	oldgen = as->as_asid_gen;
+	as->as_asid_gen = 0;
+	spinlock_release(&asid_lock);
+	asid_retired(as, oldasid, oldgen);
+	splx(spl);
+}
+
+/*
+ * Like asid_retire, but only if as isn't loaded on another cpu;
+ * returns false, having done nothing, if it is. The check and the
+ * retire are one step under asid_lock, and asid_load sets c_tlbas
+ * under it too, so no cpu can pick up the old ASID in between.
+ */
+static
+bool
+asid_retire_unloaded(struct addrspace *as)
+{
+	struct cpu *c;
+	unsigned n, oldasid, oldgen;
+	int spl;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	for (n=0; n<cpu_numcpus(); ++n) {
+		c = cpu_getcpu(n);
+		if (c != curcpu->c_self && c->c_tlbas == as) {
+			spinlock_release(&asid_lock);
+			splx(spl);
+			return false;
+		}
+	}
+	oldasid = as->as_asid;
+	oldgen = as->as_asid_gen;
+	as->as_asid_gen = 0;
+	spinlock_release(&asid_lock);
+	asid_retired(as, oldasid, oldgen);
+	splx(spl);
+	return true;
+}
+
+/*
+ * Swap.
+ *
+ * When memory runs short, private user pages are written to the raw
+ * disk lhd1 and their page table entries record the swap slot in
+ * place of the frame. Victims are chosen by a clock (second chance)
+ * sweep over the core map: vm_fault sets a frame's referenced bit
+ * whenever it maps the page, and the hand clears the bit on its first
+ * pass and takes the frame on the next. Kernel memory and frames
+ * shared copy-on-write have no owner and are never chosen.
+ *
+ * A page-out thread keeps a few frames free ahead of demand; an
+ * allocation that still comes up empty evicts a page itself.
+ */
+
+/* a swapped-out page table entry: the slot number in place of the frame */
+#define PTE_SWAPPED		0x1
+#define PTE_ISSWAP(pte)		(((pte) & PTE_SWAPPED) != 0)
+#define PTE_MKSWAP(slot)	((paddr_t)(slot) * PAGE_SIZE | PTE_SWAPPED)
+#define PTE_SLOT(pte)		(((pte) & PAGE_FRAME) / PAGE_SIZE)
+
+/* NULL if there is no swap disk; set once, at the end of swap_bootstrap */
+static struct vnode *swap_vnode;
+static unsigned swap_nslots;
+
+/* page table entries naming each slot, protected by swap_slot_lock */
+static uint16_t *swap_refs;
+static unsigned swap_nused;
+/* where to start looking for a free slot */
+static unsigned swap_hint;
+/* pages written out and read back, also under swap_slot_lock */
+static unsigned swap_evictions;
+static unsigned swap_pageins;
+static struct spinlock swap_slot_lock = SPINLOCK_INITIALIZER;
+
+/* one eviction at a time; protects the clock hand */
+static struct lock *swap_lock;
+static int swap_hand;
+
+/* the page-out thread wakes below swap_lowat free frames, sleeps at swap_hiwat */
+static unsigned swap_lowat;
+static unsigned swap_hiwat;
+static struct semaphore *pageout_sem;
+static volatile bool pageout_pending;
+
+static
+int
+swap_slot_alloc(void)
+{
+	unsigned n, slot;
+
+	spinlock_acquire(&swap_slot_lock);
+	for (n=0; n<swap_nslots; ++n) {
+		slot = (swap_hint + n) % swap_nslots;
+		if (swap_refs[slot] == 0) {
+			swap_refs[slot] = 1;
+			swap_nused++;
+			swap_hint = slot + 1;
+			spinlock_release(&swap_slot_lock);
+			return slot;
+		}
+	}
+	spinlock_release(&swap_slot_lock);
+	return -1;
+}
+
+static
+void
+swap_slot_incref(unsigned slot)
+{
+	spinlock_acquire(&swap_slot_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_slot_lock);
+}
+
+static
+void
+swap_slot_decref(unsigned slot, bool pagein)
+{
+	spinlock_acquire(&swap_slot_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		swap_nused--;
+	}
+	if (pagein) {
+		swap_pageins++;
+	}
+	spinlock_release(&swap_slot_lock);
+}
+
+/* move one page between frame pa and a swap slot */
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	} else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the page for swapped-out entry pte into frame pa and let go
+ * of its slot. Caller holds the address space lock.
+ */
+static
+int
+swap_pagein(paddr_t pte, paddr_t pa)
+{
+	int result;
+
+	KASSERT(PTE_ISSWAP(pte));
+	result = swap_io(PTE_SLOT(pte), pa, UIO_READ);
+	if (result) {
+		return result;
+	}
+	swap_slot_decref(PTE_SLOT(pte), true);
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
+}
+
+/* allocate a second-level page table with no pages in it yet */
+static
+paddr_t *
+as_create_pt(void)
+{
+	paddr_t *pt;
+
+	pt = kmalloc(PT_NENT * sizeof(paddr_t));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (unsigned i=0; i<PT_NENT; ++i) {
+		pt[i] = 0;
+	}
+	return pt;
+}
+
+/* the page table entry for user address va, or NULL if it has no table */
+static
+paddr_t *
+as_pte(struct addrspace *as, vaddr_t va)
+{
+	paddr_t *pt;
+
+	KASSERT(va < USERSPACETOP);
+	pt = as->as_pt[PT_DIR(va)];
+	return pt == NULL ? NULL : &pt[PT_ENT(va)];
+}
+
+/* like as_pte, but allocate the page table if need be */
+static
+paddr_t *
+as_pte_create(struct addrspace *as, vaddr_t va)
+{
+	KASSERT(va < USERSPACETOP);
+	if (as->as_pt[PT_DIR(va)] == NULL) {
+		as->as_pt[PT_DIR(va)] = as_create_pt();
+		if (as->as_pt[PT_DIR(va)] == NULL) {
+			return NULL;
+		}
+	}
+	return as_pte(as, va);
+}
+
+/*
+ * Run the clock hand to a victim, write it to a free swap slot, and
+ * point its page table entry at the slot. Returns the frame, still
+ * allocated with a refcount of 1, or 0 if nothing could be evicted.
+ *
+ * The victim's address space lock is taken with lock_tryacquire so
+ * that a faulting thread, which holds its own lock while it waits
+ * for memory, can never deadlock against us; if that thread is us,
+ * its pages are fair game. Address spaces loaded on another cpu are
+ * skipped, since we have no TLB shootdown to reach the ASID in use
+ * there.
+ */
+static
+paddr_t
+swap_evict(void)
+{
+	struct CoreMap *cm;
+	struct addrspace *as = NULL;
+	vaddr_t va = 0;
+	paddr_t pa = 0, *pte;
+	bool mine = false;
+	int n, i, slot, result;
+
+	lock_acquire(swap_lock);
+	slot = swap_slot_alloc();
+	if (slot < 0) {
+		lock_release(swap_lock);
+		return 0;
+	}
+
+	/* two full turns: the first may only clear referenced bits */
+	for (n=0; n<2*total_frames && pa == 0; ++n) {
+		i = swap_hand;
+		swap_hand = (swap_hand + 1) % total_frames;
+		cm = &core_map[i];
+
+		spinlock_acquire(&cm_ref_lock);
+		if (cm->owner == NULL || cm->refcount != 1) {
+			spinlock_release(&cm_ref_lock);
+			continue;
+		}
+		if (cm->referenced) {
+			cm->referenced = false;
+			spinlock_release(&cm_ref_lock);
+			continue;
+		}
+		as = cm->owner;
+		mine = lock_do_i_hold(as->as_lock);
+		if (!mine && !lock_tryacquire(as->as_lock)) {
+			spinlock_release(&cm_ref_lock);
+			continue;
+		}
+		/* with as locked, nobody else can map or unmap the frame */
+		va = cm->vaddr;
+		cm->owner = NULL;
+		spinlock_release(&cm_ref_lock);
+
+		/* drop every cached mapping of the page, if we can */
+		if (!asid_retire_unloaded(as)) {
+			spinlock_acquire(&cm_ref_lock);
+			cm->owner = as;
+			spinlock_release(&cm_ref_lock);
+			if (!mine) {
+				lock_release(as->as_lock);
+			}
+			continue;
+		}
+		pa = cm_paddr(i);
+	}
+
+	if (pa == 0) {
+		swap_slot_decref(slot, false);
+		lock_release(swap_lock);
+		return 0;
+	}
+
+	pte = as_pte(as, va);
+	KASSERT(pte != NULL && *pte == pa);
+
+	result = swap_io(slot, pa, UIO_WRITE);
+	if (result) {
+		kprintf("swap: writing slot %d: %s\n", slot, strerror(result));
+		swap_slot_decref(slot, false);
+		spinlock_acquire(&cm_ref_lock);
+		cm->owner = as;
+		spinlock_release(&cm_ref_lock);
+		pa = 0;
+	}
+	else {
+		*pte = PTE_MKSWAP(slot);
+		spinlock_acquire(&swap_slot_lock);
+		swap_evictions++;
+		spinlock_release(&swap_slot_lock);
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+
+	if (!mine) {
+		lock_release(as->as_lock);
+	}
+	lock_release(swap_lock);
+	return pa;
+}
+
+/* give an evicted frame back to the coremap */
+static
+void
+swap_release(paddr_t pa)
+{
+	spinlock_acquire(&cm_ref_lock);
+	core_map[cm_index(pa)].refcount = 0;
+	spinlock_release(&cm_ref_lock);
+
+	spinlock_acquire(&stealmem_lock);
+	cm_free(pa);
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * True if the current thread may evict pages to satisfy an
+ * allocation: there is swap, and we may sleep.
+ */
+static
+bool
+swap_can_evict(void)
+{
+	return swap_vnode != NULL && !curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		!lock_do_i_hold(swap_lock);
+}
+
+/* evict pages until a block of npages frames can be allocated */
+static
+paddr_t
+swap_reclaim(unsigned long npages)
+{
+	paddr_t pa;
+	int n;
+
+	if (npages == 1) {
+		return swap_evict();
+	}
+	for (n=0; n<total_frames; ++n) {
+		pa = swap_evict();
+		if (pa == 0) {
+			return 0;
+		}
+		swap_release(pa);
+		spinlock_acquire(&stealmem_lock);
+		pa = cm_alloc(npages);
+		spinlock_release(&stealmem_lock);
+		if (pa != 0) {
+			return pa;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free frames, counting the ones parked in the per-cpu page caches;
+ * those are as good as free, and mustn't make the pager write pages
+ * out. Read without locks, as a hint.
+ */
+static
+unsigned
+swap_freeframes(void)
+{
+	unsigned n, i;
+
+	n = cm_nfreepages;
+	for (i=0; i<cpu_numcpus(); ++i) {
+		n += cpu_getcpu(i)->c_pcache_count;
+	}
+	return n;
+}
+
+/* wake the page-out thread if free memory is getting low */
+static
+void
+swap_kick(void)
+{
+	if (swap_vnode == NULL || pageout_pending ||
+	    swap_freeframes() >= swap_lowat) {
+		return;
+	}
+	pageout_pending = true;
+	V(pageout_sem);
+}
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	paddr_t pa;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		P(pageout_sem);
+		while (swap_freeframes() < swap_hiwat) {
+			pa = swap_evict();
+			if (pa == 0) {
+				break;
+			}
+			swap_release(pa);
+		}
+		pageout_pending = false;
+	}
+}
+
+/*
+ * Open the swap disk and start the page-out thread. Without a swap
+ * disk the system runs as before and fails allocations it can't
+ * satisfy from memory.
+ */
+static
+void
+swap_bootstrap(void)
+{
+	char path[] = "lhd1raw:";
+	struct vnode *v;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &v);
+	if (result) {
+		kprintf("swap: lhd1raw: %s; no paging to disk\n",
+			strerror(result));
+		return;
+	}
+	result = VOP_STAT(v, &st);
+	if (result || st.st_size < PAGE_SIZE) {
+		kprintf("swap: lhd1raw: unusable; no paging to disk\n");
+		vfs_close(v);
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+	swap_lock = lock_create("swap");
+	pageout_sem = sem_create("pageout", 0);
+	if (swap_refs == NULL || swap_lock == NULL || pageout_sem == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	for (unsigned n=0; n<swap_nslots; ++n) {
+		swap_refs[n] = 0;
+	}
+	swap_nused = 0;
+	swap_hint = 0;
+	swap_hand = 0;
+	swap_lowat = total_frames / 32 + 1;
+	swap_hiwat = 2 * swap_lowat;
+	pageout_pending = false;
+
+	result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("swap_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	swap_vnode = v;
+	kprintf("swap: %u pages on lhd1raw:\n", swap_nslots);
+}
+#endif
+
+void
+vm_bootstrap(void)
+{
+	/* Do nothing. */
+	#if OPT_A3
+	/* call ram_getsize to get the remaining physical memory in the system */
+	paddr_t lo, hi;
+	ram_getsize(&lo, &hi);
+
+	/* Logically partition the memory into fixed size frames. 
+	Each frame is PAGE_SIZE bytes.
+	*/
+	int num_of_frames = (hi - lo)/PAGE_SIZE; 
+
+	/* Store core map in the start of the memory returned by ram_getsize. */
+	core_map = (struct CoreMap *)PADDR_TO_KVADDR(lo);
+
+	/* find total memories that core map can use */
+	lo += num_of_frames * sizeof(struct CoreMap);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+
+	/* calculate real num of frames after set up core map */
+	num_of_frames = (hi - lo)/PAGE_SIZE;
+	cm_base = lo;
+
+	for (int order=0; order<=CM_MAXORDER; ++order) {
+		cm_freelist[order] = CM_NONE;
+		cm_nfree[order] = 0;
+		cm_nused[order] = 0;
+	}
+	cm_nfreepages = 0;
+	cm_pages_alloc = 0;
+	cm_pages_req = 0;
+
+	/* set up core map*/
+	for (int i=0; i<num_of_frames; ++i) {
+		core_map[i].head = false;
+		core_map[i].use = false;
+		core_map[i].order = 0;
+		core_map[i].npages = 0;
+		core_map[i].next = CM_NONE;
+		core_map[i].prev = CM_NONE;
+		core_map[i].refcount = 0;
+		core_map[i].owner = NULL;
+		core_map[i].vaddr = 0;
+		core_map[i].referenced = false;
+	}
+
+	/* carve the frames into the largest aligned blocks that fit */
+	for (int i=0; i<num_of_frames; ) {
+		int order = CM_MAXORDER;
+		while (order > 0 &&
+		       ((i & ((1 << order) - 1)) != 0 ||
+			i + (1 << order) > num_of_frames)) {
+			--order;
+		}
+		cm_push(i, order);
+		i += 1 << order;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	total_frames = num_of_frames;
+	spinlock_release(&stealmem_lock);
+
+	vmstats_init();
+	swap_bootstrap();
+	#endif
+}
+
+#if OPT_A3
+/*
+ * Per-cpu page caches.
+ *
+ * Single-page allocations and frees go through the current cpu's
+ * cache and only take stealmem_lock to move a batch of frames to or
+ * from the coremap. The cache lock is always taken before
+ * stealmem_lock.
+ */
+
+/* top up the cache from the coremap; caller holds c_pcache_lock */
+static
+void
+pcache_refill(struct cpu *c)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&stealmem_lock);
+	while (c->c_pcache_count < CPU_PCACHE_BATCH) {
+		pa = cm_alloc(1);
+		if (pa == 0) {
+			break;
+		}
+		c->c_pcache[c->c_pcache_count++] = pa;
+	}
+	spinlock_release(&stealmem_lock);
+	c->c_pcache_refills++;
+}
+
+/* give all but keep frames back to the coremap; caller holds c_pcache_lock */
+static
+void
+pcache_drain(struct cpu *c, unsigned keep)
+{
+	if (c->c_pcache_count <= keep) {
+		return;
+	}
+	spinlock_acquire(&stealmem_lock);
+	while (c->c_pcache_count > keep) {
+		cm_free(c->c_pcache[--c->c_pcache_count]);
+	}
+	spinlock_release(&stealmem_lock);
+	c->c_pcache_drains++;
+}
+
+/*
+ * Empty every cpu's cache back into the coremap. Used when an
+ * allocation fails, since the frames it needs may be sitting idle in
+ * another cpu's cache.
+ */
+static
+void
+pcache_flushall(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpu_numcpus(); ++i) {
+		c = cpu_getcpu(i);
+		spinlock_acquire(&c->c_pcache_lock);
+		pcache_drain(c, 0);
+		spinlock_release(&c->c_pcache_lock);
+	}
+}
+
+static
+paddr_t
+pcache_alloc(void)
+{
+	struct cpu *c;
+	paddr_t pa = 0;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pcache_lock);
+	if (c->c_pcache_count > 0) {
+		c->c_pcache_hits++;
+	} else {
+		c->c_pcache_misses++;
+		pcache_refill(c);
+	}
+	if (c->c_pcache_count > 0) {
+		pa = c->c_pcache[--c->c_pcache_count];
+	}
+	spinlock_release(&c->c_pcache_lock);
+	return pa;
+}
+
+static
+void
+pcache_free(paddr_t pa)
+{
+	struct cpu *c;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pcache_lock);
+	if (c->c_pcache_count == CPU_PCACHE_SIZE) {
+		pcache_drain(c, CPU_PCACHE_SIZE - CPU_PCACHE_BATCH);
+	}
+	c->c_pcache[c->c_pcache_count++] = pa;
+	spinlock_release(&c->c_pcache_lock);
+}
+#endif
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	#if OPT_A3
+	/* total_frames is only written once, at vm_bootstrap */
+	if (total_frames > 0) {
+		addr = npages == 1 ? pcache_alloc() : 0;
+		if (addr == 0) {
+			spinlock_acquire(&stealmem_lock);
+			addr = cm_alloc(npages);
+			spinlock_release(&stealmem_lock);
+		}
+		if (addr == 0) {
+			/* last resort: frames idling in other cpus' caches */
+			pcache_flushall();
+			spinlock_acquire(&stealmem_lock);
+			addr = cm_alloc(npages);
+			spinlock_release(&stealmem_lock);
+		}
+		if (addr == 0 && swap_can_evict()) {
+			/* push user pages out to disk until npages fit */
+			addr = swap_reclaim(npages);
+		}
+		if (addr != 0) {
+			/* nobody else can see this frame yet */
+			spinlock_acquire(&cm_ref_lock);
+			core_map[cm_index(addr)].refcount = 1;
+			core_map[cm_index(addr)].owner = NULL;
+			core_map[cm_index(addr)].referenced = false;
+			spinlock_release(&cm_ref_lock);
+		}
+		swap_kick();
+		return addr;
+	}
+	#endif
+
+	spinlock_acquire(&stealmem_lock);
+	addr = ram_stealmem(npages);
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+#if OPT_A3
+static
+void
+freeppages(paddr_t paddr)
+{
+	int i;
+
+	/* memory stolen before vm_bootstrap is outside the core map; leak it */
+	if (total_frames == 0 || paddr < cm_base ||
+	    paddr >= cm_paddr(total_frames)) {
+		return;
+	}
+
+	/*
+	 * The caller owns this block, so nobody else changes its
+	 * core map entry and we can look at its order unlocked.
+	 */
+	i = cm_index(paddr);
+	KASSERT(core_map[i].head && core_map[i].use);
+	if (core_map[i].order == 0) {
+		pcache_free(paddr);
+		return;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	cm_free(paddr);
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * Reference counts on user frames. A frame mapped by more than one
+ * address space is shared copy-on-write; it goes back to the
+ * allocator when the last address space lets go of it.
+ */
+static
+void
+page_incref(paddr_t paddr)
+{
+	spinlock_acquire(&cm_ref_lock);
+	KASSERT(core_map[cm_index(paddr)].refcount > 0);
+	core_map[cm_index(paddr)].refcount++;
+	/* shared frames stay in memory */
+	core_map[cm_index(paddr)].owner = NULL;
+	cm_cow_shares++;
+	spinlock_release(&cm_ref_lock);
+}
+
+static
+void
+page_decref(paddr_t paddr)
+{
+	int refs;
+
+	spinlock_acquire(&cm_ref_lock);
+	KASSERT(core_map[cm_index(paddr)].refcount > 0);
+	refs = --core_map[cm_index(paddr)].refcount;
+	if (refs == 0) {
+		core_map[cm_index(paddr)].owner = NULL;
+	}
+	spinlock_release(&cm_ref_lock);
+
+	if (refs == 0) {
+		freeppages(paddr);
+	}
+}
+
+static
+bool
+page_shared(paddr_t paddr)
+{
+	bool shared;
+
+	spinlock_acquire(&cm_ref_lock);
+	shared = core_map[cm_index(paddr)].refcount > 1;
+	spinlock_release(&cm_ref_lock);
+	return shared;
+}
+
+/*
+ * Note that the page at va in as has just been mapped from paddr.
+ * If the frame is private to as it becomes a candidate for eviction.
+ */
+static
+void
+page_setowner(paddr_t paddr, struct addrspace *as, vaddr_t va)
+{
+	struct CoreMap *cm = &core_map[cm_index(paddr)];
+
+	spinlock_acquire(&cm_ref_lock);
+	if (cm->refcount == 1) {
+		cm->owner = as;
+		cm->vaddr = va;
+	}
+	cm->referenced = true;
+	spinlock_release(&cm_ref_lock);
+}
+#endif
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	#if OPT_A3
+	/* transfer vaddr to paddr */
+	freeppages(addr - MIPS_KSEG0);
+
+	#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+	#endif
+}
+
+#if OPT_A3
+/* number of frames on the free lists right now */
+unsigned
+coremap_freepages(void)
+{
+	unsigned n;
+
+	spinlock_acquire(&stealmem_lock);
+	n = cm_nfreepages;
+	spinlock_release(&stealmem_lock);
+	return n;
+}
+
+/*
+ * Print per-order occupancy and fragmentation of the core map, and
+ * per-cpu page cache effectiveness. Called from the kh menu command.
+ * Frames sitting in page caches count as used blocks of order 0.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned nfree[CM_MAXORDER+1], nused[CM_MAXORDER+1];
+	unsigned alloc_pages, req_pages, free_pages, largest;
+	int order, frames;
+
+	/* take a snapshot so we don't print with the lock held */
+	spinlock_acquire(&stealmem_lock);
+	for (order=0; order<=CM_MAXORDER; ++order) {
+		nfree[order] = cm_nfree[order];
+		nused[order] = cm_nused[order];
+	}
+	alloc_pages = cm_pages_alloc;
+	req_pages = cm_pages_req;
+	frames = total_frames;
+	spinlock_release(&stealmem_lock);
+
+	free_pages = 0;
+	largest = 0;
+	kprintf("Coremap status (%d frames):\n", frames);
+	kprintf("    order  pages    free    used\n");
+	for (order=0; order<=CM_MAXORDER; ++order) {
+		kprintf("    %5d %6u %7u %7u\n", order, 1U << order,
+			nfree[order], nused[order]);
+		free_pages += nfree[order] << order;
+		if (nfree[order] > 0) {
+			largest = 1U << order;
+		}
+	}
+	kprintf("    %u pages free, largest free block %u pages\n",
+		free_pages, largest);
+	if (free_pages > 0) {
+		/* share of free memory not in the largest free block */
+		kprintf("    external fragmentation: %u%%\n",
+			100 - (largest * 100) / free_pages);
+	}
+	kprintf("    %u pages allocated for %u requested "
+		"(internal fragmentation: %u pages)\n",
+		alloc_pages, req_pages, alloc_pages - req_pages);
+
+	spinlock_acquire(&cm_ref_lock);
+	kprintf("    copy-on-write: %u frames shared, %u copied, "
+		"%u reclaimed by the last sharer\n",
+		cm_cow_shares, cm_cow_copies, cm_cow_reuses);
+	spinlock_release(&cm_ref_lock);
+
+	spinlock_acquire(&asid_lock);
+	kprintf("    ASID generation %u, next ASID %u of %u\n",
+		asid_gen, asid_next, NUM_ASID);
+	spinlock_release(&asid_lock);
+
+	if (swap_vnode != NULL) {
+		unsigned used, evictions, pageins;
+
+		spinlock_acquire(&swap_slot_lock);
+		used = swap_nused;
+		evictions = swap_evictions;
+		pageins = swap_pageins;
+		spinlock_release(&swap_slot_lock);
+		kprintf("    swap: %u of %u slots in use, %u pages evicted, "
+			"%u read back\n", used, swap_nslots,
+			evictions, pageins);
+	}
+
+	kprintf("Per-cpu page caches:\n");
+	kprintf("    cpu cached     hits   misses hit%% refills  drains\n");
+	for (unsigned n=0; n<cpu_numcpus(); ++n) {
+		struct cpu *c = cpu_getcpu(n);
+		unsigned cached, hits, misses, refills, drains;
+
+		spinlock_acquire(&c->c_pcache_lock);
+		cached = c->c_pcache_count;
+		hits = c->c_pcache_hits;
+		misses = c->c_pcache_misses;
+		refills = c->c_pcache_refills;
+		drains = c->c_pcache_drains;
+		spinlock_release(&c->c_pcache_lock);
+
+		kprintf("    %3u %6u %8u %8u %3u%% %7u %7u\n", n, cached,
+			hits, misses,
+			hits + misses ? (hits * 100) / (hits + misses) : 0,
+			refills, drains);
+	}
+}
+#endif
+
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+#if OPT_A3
+/*
+ * Fill in a newly allocated frame for the user page at pageva. The
+ * part of the page that overlaps the file-backed range
+ * [file_vaddr, file_vaddr+file_size) is read from the executable;
+ * the rest is zeroed.
+ */
+static
+int
+as_load_page(struct addrspace *as, paddr_t paddr, vaddr_t pageva,
+	     vaddr_t file_vaddr, off_t file_offset, size_t file_size)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	as_zero_region(paddr, 1);
+
+	start = pageva > file_vaddr ? pageva : file_vaddr;
+	end = pageva + PAGE_SIZE;
+	if (end > file_vaddr + file_size) {
+		end = file_vaddr + file_size;
+	}
+	if (file_size == 0 || start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	KASSERT(as->as_vnode != NULL);
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - pageva)),
+		  end - start, file_offset + (start - file_vaddr), UIO_READ);
+	result = VOP_READ(as->as_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on page - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+/*
+ * Make the page in *pte private to this address space before it is
+ * written: copy it if another address space still shares the frame.
+ */
+static
+int
+as_cow_break(paddr_t *pte)
+{
+	paddr_t old, new;
+
+	old = *pte;
+	if (!page_shared(old)) {
+		/* everyone else has let go; the frame is ours now */
+		spinlock_acquire(&cm_ref_lock);
+		cm_cow_reuses++;
+		spinlock_release(&cm_ref_lock);
+		return 0;
+	}
+
+	new = getppages(1);
+	if (new == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(new),
+		(const void *)PADDR_TO_KVADDR(old), PAGE_SIZE);
+	*pte = new;
+	page_decref(old);
+
+	spinlock_acquire(&cm_ref_lock);
+	cm_cow_copies++;
+	spinlock_release(&cm_ref_lock);
+	return 0;
+}
+#endif
+
+#if OPT_A3
+/* the region containing va, or NULL if va is in none */
+static
+struct region *
+as_region_find(struct addrspace *as, vaddr_t va)
+{
+	struct region *r;
+
+	for (r = as->as_regions; r != NULL; r = r->r_next) {
+		if (va >= r->r_vbase &&
+		    va < r->r_vbase + r->r_npages * PAGE_SIZE) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Grow the stack down to cover va, if va is below the stack but within
+ * the stack limit and the guard page. Returns the stack region, or
+ * NULL if va is not a stack access.
+ */
+static
+struct region *
+as_stack_grow(struct addrspace *as, vaddr_t va)
+{
+	struct region *stack, *r;
+	vaddr_t base, floor;
+
+	stack = as->as_stack;
+	if (stack == NULL || va >= stack->r_vbase ||
+	    va < USERSTACK - DUMBVM_STACKLIMIT) {
+		return NULL;
+	}
+	base = va & PAGE_FRAME;
+
+	/* keep a guard page above whatever lies below the stack */
+	floor = 0;
+	for (r = as->as_regions; r != stack; r = r->r_next) {
+		floor = r->r_vbase + r->r_npages * PAGE_SIZE + PAGE_SIZE;
+	}
+	if (base < floor) {
+		return NULL;
+	}
+
+	stack->r_npages += (stack->r_vbase - base) / PAGE_SIZE;
+	stack->r_vbase = base;
+	return stack;
+}
+
+/*
+ * vm_fault proper. The caller holds the address space lock, which
+ * keeps the pager away from our page tables for the whole fault.
+ */
+static
+int
+vm_fault_locked(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	struct region *r;
+	struct cpu *c;
+	paddr_t paddr, *pte;
+	int i;
+	uint32_t ehi, elo;
+	int spl;
+	/* region permission; text is never writeable */
+	bool writeable;
+	/* whether the TLB entry may be written through */
+	bool dirty;
+	int result;
+
+	r = as_region_find(as, faultaddress);
+	if (r == NULL) {
+		r = as_stack_grow(as, faultaddress);
+		if (r == NULL) {
+			return EFAULT;
+		}
+	}
+	/* load_elf may still be filling in read-only segments */
+	writeable = r->r_writeable || !as->complete_load_elf;
+
+	pte = as_pte_create(as, faultaddress);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/*
+		 * The page is loaded but mapped read-only. That's
+		 * final for text; for everything else it means the
+		 * frame was shared by fork and this write gets its own
+		 * copy.
+		 */
+		if (!writeable || *pte == 0) {
+			return EFAULT;
+		}
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	if (PTE_ISSWAP(*pte)) {
+		/* evicted earlier: read it back from its swap slot */
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = swap_pagein(*pte, paddr);
+		if (result) {
+			freeppages(paddr);
+			return result;
+		}
+		*pte = paddr;
+	}
+	else if (*pte == 0) {
+		/* first touch: give the page a frame and fill it in */
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		result = as_load_page(as, paddr, faultaddress, r->r_file_vaddr,
+				      r->r_file_offset, r->r_file_size);
+		if (result) {
+			freeppages(paddr);
+			return result;
+		}
+		*pte = paddr;
+	}
+	else if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+
+	/*
+	 * Shared frames are mapped read-only so the first write
+	 * faults; if this fault is that write, copy now instead.
+	 */
+	dirty = writeable;
+	if (writeable &&
+	    (faulttype == VM_FAULT_READONLY || page_shared(*pte))) {
+		if (faulttype != VM_FAULT_READ) {
+			result = as_cow_break(pte);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			dirty = false;
+		}
+	}
+	paddr = *pte;
+	page_setowner(paddr, as, faultaddress);
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	ehi = faultaddress | TLBHI_ASID(as->as_asid);
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	if (!dirty) {
+		elo &= ~TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	/* a read-only fault replaces the entry that caused it, if still there */
+	if (faulttype == VM_FAULT_READONLY) {
+		i = tlb_probe(ehi, 0);
+		if (i >= 0) {
+			tlb_write(ehi, elo, i);
+			splx(spl);
+			return 0;
+		}
+	}
+
+	/*
+	 * Take a slot known to be empty if there is one, otherwise
+	 * let the hardware pick a victim. Either way c0_entryhi ends
+	 * up holding our ASID again.
+	 */
+	if (c->c_tlb.ct_nfree > 0) {
+		i = c->c_tlb.ct_free[--c->c_tlb.ct_nfree];
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		}
+		tlb_random(ehi, elo);
 	}
-	return PADDR_TO_KVADDR(pa);
+	splx(spl);
+	return 0;
 }
 
-void 
-free_kpages(vaddr_t addr)
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	#if OPT_A3
-	spinlock_acquire(&stealmem_lock);
-//	kprintf("vaddr = %u\n", addr);
-	/* transfer vaddr to paddr */
-	paddr_t paddr = addr - MIPS_KSEG0;
-//	kprintf("paddr = %u\n", paddr);
-
-	/* find the paddr in core map */
-	for(int i=0; i<total_frames; ++i) {
-		if (core_map[i].start_addr == paddr) {
-			for (int j=0; j<=core_map[i].total_block; ++j) {
-				core_map[i+j].use = false;
-				core_map[i+j].total_block = 1;
-				core_map[i+j].block_num = 1;
-			}
-			break;
-		}
+	struct addrspace *as;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/* a write to a copy-on-write or read-only page */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
 	}
-	spinlock_release(&stealmem_lock);
 
-	#else
-	/* nothing - leak the memory. */
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
 
-	(void)addr;
-	#endif
-}
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
 
-void
-vm_tlbshootdown_all(void)
-{
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pt != NULL);
+	KASSERT(as->as_lock != NULL);
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	lock_acquire(as->as_lock);
+	result = vm_fault_locked(as, faulttype, faultaddress);
+	lock_release(as->as_lock);
+	return result;
 }
 
+#else
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -231,11 +1755,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 	int spl;
 
-	#if OPT_A3
-	/* check if this entry is a text segment */
-	bool text_seg = false;
-	#endif
-
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
@@ -243,14 +1762,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 		/* We always create pages read-write, so we can't get this */
-
-		#if OPT_A3
-	    return EINVAL;
-
-		#else
 		panic("dumbvm: got VM_FAULT_READONLY\n");
-		#endif
-
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -290,12 +1802,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
-	#if OPT_A3
-	KASSERT(as->as_pt1 != NULL);
-	KASSERT(as->as_pt2 != NULL);
-	KASSERT(as->as_stack_pt != NULL);
-	#endif
-
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
 	vbase2 = as->as_vbase2;
@@ -304,11 +1810,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stacktop = USERSTACK;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		/* this is the text and code segment */
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-		#if OPT_A3
-		text_seg = true;
-		#endif
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
@@ -331,44 +1833,19 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		if (elo & TLBLO_VALID) {
 			continue;
 		}
-		/* 
-		valid bit != 1
-		overwrites the unused entry with the virtual to physical address mapping
-		required by the instruction that generated the TLB exception 
-		*/ 
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-
-		#if OPT_A3
-		if (text_seg && as->complete_load_elf) {
-			elo&=~TLBLO_DIRTY;
-		}
-		#endif
-
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
 
-	#if OPT_A3
-	/* call tlb_random to write the entry into a random TLB slot */
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (text_seg && as->complete_load_elf) {
-			elo&=~TLBLO_DIRTY;
-	}
-	tlb_random(ehi, elo);
-//	kprintf("call tlb_random\n");
-	splx(spl);
-	return 0;
-
-	#else
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
-	#endif
 }
+#endif
 
 struct addrspace *
 as_create(void)
@@ -379,23 +1856,30 @@ as_create(void)
 	}
 
 	#if OPT_A3
-	as->as_vbase1 = 0;
-	as->as_pt1 = NULL;
-	as->as_pt1_executable = false;
-	as->as_pt1_readable = false;
-	as->as_pt1_writeable = false;
-	as->as_npages1 = 0;
-
-	as->as_vbase2 = 0;
-	as->as_pt2 = NULL;	
-	as->as_pt2_executable = false;
-	as->as_pt2_readable = false;
-	as->as_pt2_writeable = false;
-	as->as_npages2 = 0;
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_stack = NULL;
+	as->as_heap_end = 0;
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	as->complete_load_elf = false;
+	as->as_vnode = NULL;
 
-	as->as_stack_pt = 0;
+	as->as_pt = kmalloc(PT_NDIR * sizeof(paddr_t *));
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	for (unsigned d=0; d<PT_NDIR; ++d) {
+		as->as_pt[d] = NULL;
+	}
 
-	as->complete_load_elf = false;
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
 	#else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
@@ -409,30 +1893,55 @@ as_create(void)
 	return as;
 }
 
+#if OPT_A3
+/* drop every frame and swap slot the page tables hold, then the tables */
+static
+void
+as_free_pt(struct addrspace *as)
+{
+	paddr_t *pt;
+
+	for (unsigned d=0; d<PT_NDIR; ++d) {
+		pt = as->as_pt[d];
+		if (pt == NULL) {
+			continue;
+		}
+		for (unsigned i=0; i<PT_NENT; ++i) {
+			if (PTE_ISSWAP(pt[i])) {
+				swap_slot_decref(PTE_SLOT(pt[i]), false);
+			}
+			else if (pt[i] != 0) {
+				page_decref(pt[i]);
+			}
+		}
+		kfree(pt);
+		as->as_pt[d] = NULL;
+	}
+}
+#endif
+
 void
 as_destroy(struct addrspace *as)
 {
 	/* free pages in thest memory region */
 	#if OPT_A3
-	/*
-	for (int i=0; i<total_frames; ++i) {
-		core_map[i].use = false;
-		core_map[i].total_block = 1;
-		core_map[i].block_num = 1;
+	struct region *r;
+
+	/* wait out the pager if it is writing one of our pages */
+	lock_acquire(as->as_lock);
+	as_free_pt(as);
+	lock_release(as->as_lock);
+	lock_destroy(as->as_lock);
+	kfree(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		r = as->as_regions;
+		as->as_regions = r->r_next;
+		kfree(r);
 	}
-	*/
-	for (size_t i=0; i<as->as_npages1; ++i) {
-		free_kpages(as->as_pt1[i]);
-	}
-	kfree(as->as_pt1);
-	for (size_t i=0; i<as->as_npages2; ++i) {
-		free_kpages(as->as_pt2[i]);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
 	}
-	kfree(as->as_pt2);
-	for (size_t i=0; i<DUMBVM_STACKPAGES; ++i) {
-		free_kpages(as->as_stack_pt[i]);
-	}
-	kfree(as->as_stack_pt);
 	#endif
 
 	kfree(as);
@@ -441,7 +1950,10 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
-	int i, spl;
+	#if !OPT_A3
+	int i;
+	#endif
+	int spl;
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -455,9 +1967,14 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+	/* entries are tagged with their ASID; no need to flush */
+	asid_load(as);
+	#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	#endif
 
 	splx(spl);
 }
@@ -468,6 +1985,59 @@ as_deactivate(void)
 	/* nothing */
 }
 
+#if OPT_A3
+/*
+ * Add the region [vaddr, vaddr + npages*PAGE_SIZE) to as, keeping the
+ * list sorted. Fails with EINVAL if it would overlap another region
+ * or reach into the kernel. Hands back the new region if ret isn't
+ * NULL.
+ */
+static
+int
+as_region_add(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      int readable, int writeable, int executable,
+	      struct region **ret)
+{
+	struct region *r, **prev;
+	vaddr_t top = vaddr + npages * PAGE_SIZE;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	if (top < vaddr || top > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	for (prev = &as->as_regions; *prev != NULL; prev = &(*prev)->r_next) {
+		r = *prev;
+		if (r->r_vbase >= top) {
+			break;
+		}
+		if (r->r_vbase + r->r_npages * PAGE_SIZE > vaddr) {
+			return EINVAL;
+		}
+	}
+
+	r = kmalloc(sizeof(struct region));
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	r->r_vbase = vaddr;
+	r->r_npages = npages;
+	r->r_readable = readable;
+	r->r_writeable = writeable;
+	r->r_executable = executable;
+	r->r_file_vaddr = 0;
+	r->r_file_offset = 0;
+	r->r_file_size = 0;
+	r->r_next = *prev;
+	*prev = r;
+
+	if (ret != NULL) {
+		*ret = r;
+	}
+	return 0;
+}
+#endif
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -484,28 +2054,9 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	npages = sz / PAGE_SIZE;
 
 	#if OPT_A3
-	/* Allocate (kmalloc) and initialize the page table for the specified segment */
-	if (as->as_pt1 == NULL) {
-		as->as_pt1 = kmalloc(npages * sizeof(struct PTE));
-		as->as_pt1_readable = readable;
-		as->as_pt1_writeable = writeable;
-		as->as_pt1_executable = executable;
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
-	}
-	if (as->as_pt2 == NULL) {
-		as->as_pt2 = kmalloc(npages * sizeof(struct PTE));
-		as->as_pt2_readable = readable;
-		as->as_pt2_writeable = writeable;
-		as->as_pt2_executable = executable;
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
-	}
-	if (as->as_stack_pt == NULL) {
-		as->as_stack_pt = kmalloc(DUMBVM_STACKPAGES * sizeof(struct PTE));
-	}
+	/* no frames yet - vm_fault fills pages in as they are touched */
+	return as_region_add(as, vaddr, npages, readable, writeable,
+			     executable, NULL);
 
 	#else 
 	
@@ -514,71 +2065,32 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	(void)writeable;
 	(void)executable;
 
-//	#endif
-
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
-/*
-		#if OPT_A3
-		as->as_pbase1 = page_table;
-		#endif
-*/
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
-/*
-		#if OPT_A3
-		as->as_pbase2 = page_table;
-		#endif
-*/
 		return 0;
 	}
-	#endif
+
 	/*
 	 * Support for more than two regions is not available.
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
-}
-
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	#endif
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
 	#if OPT_A3
-	as->as_pt1[0] = getppages(1);
-	as->as_pbase1 = as->as_pt1[0];
-	for (size_t i=1; i<as_npages1; ++i) {
-		as->as_pt1[i] = getppages(1);
-		if (as->as_pt1[i] == 0) return ENOMEM;
-		as_zero_region(as->as_pt1[i], 1);
-	}
-
-	as->as_pt2[0] = getppages(1);
-	as->as_pbase2 = as->as_pt2[0];
-	for (size_t i=1; i<as_npages2; ++i) {
-		as->as_pt2[i] = getppages(1);
-		if (as->as_pt2[i] == 0) return ENOMEM;
-		as_zero_region(as->as_pt2[i], 1);
-	}
-
-	as->as_stack_pt[0] = getppages(1);
-	as->as_stackpbase = as->as_stack_pt[0];
-	for (size_t i=1; i<DUMBVM_STACKPAGES; ++i) {
-		as->as_stack_pt[i] = getppages(1);
-		if (as->as_stack_pt[i] == 0) return ENOMEM;
-		as_zero_region(as->as_stack_pt[i], 1);
-	}
+	/* page tables are filled in on demand; nothing to allocate */
+	KASSERT(as->as_pt != NULL);
 
 	#else 
 	KASSERT(as->as_pbase1 == 0);
@@ -613,49 +2125,232 @@ as_complete_load(struct addrspace *as)
 {
 	/* set the flag of completing load_elf to be true */
 	#if OPT_A3
+	struct region *r;
+	vaddr_t top = 0;
+
 	as->complete_load_elf = true;
+
+	/* the heap starts out empty, just above the highest segment */
+	for (r = as->as_regions; r != NULL; r = r->r_next) {
+		if (r->r_vbase + r->r_npages * PAGE_SIZE > top) {
+			top = r->r_vbase + r->r_npages * PAGE_SIZE;
+		}
+	}
+	as->as_heap_end = top;
+	return as_region_add(as, top, 0, 1, 1, 0, &as->as_heap);
 	#else
 
 	(void)as;
-	#endif
-
 	return 0;
+	#endif
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	#if OPT_A3
+	int result;
+
+	/* vm_fault grows it from here */
+	result = as_region_add(as, USERSTACK - PAGE_SIZE, 1, 1, 1, 0,
+			       &as->as_stack);
+	if (result) {
+		return result;
+	}
+	#else
 	KASSERT(as->as_stackpbase != 0);
+	#endif
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+#if OPT_A3
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct region *r;
+
+	if (filesize == 0) {
+		return 0;
+	}
+	/* all segments of a program come from the same file */
+	KASSERT(as->as_vnode == NULL || as->as_vnode == v);
+
+	r = as_region_find(as, vaddr);
+	if (r == NULL || vaddr + filesize > r->r_vbase + r->r_npages * PAGE_SIZE ||
+	    r->r_file_size != 0) {
+		return ENOEXEC;
+	}
+	r->r_file_vaddr = vaddr;
+	r->r_file_offset = offset;
+	r->r_file_size = filesize;
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap;
+	vaddr_t newend, limit, va, oldtop, newtop;
+	paddr_t *pte;
+	bool unmapped = false;
+
+	lock_acquire(as->as_lock);
+	heap = as->as_heap;
+	if (heap == NULL) {
+		/* no program loaded */
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	newend = as->as_heap_end + amount;
+	if (amount < 0 && (newend < heap->r_vbase || newend > as->as_heap_end)) {
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	/*
+	 * The heap may grow up to the next region, normally the stack,
+	 * less the stack's guard page.
+	 */
+	limit = USERSPACETOP;
+	if (heap->r_next != NULL) {
+		limit = heap->r_next->r_vbase;
+		if (heap->r_next == as->as_stack) {
+			limit -= PAGE_SIZE;
+		}
+	}
+	if (amount > 0 && (newend < as->as_heap_end || newend > limit)) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	oldtop = heap->r_vbase + heap->r_npages * PAGE_SIZE;
+	newtop = ROUNDUP(newend, PAGE_SIZE);
+
+	/* pages above the new end are gone; drop them and their mappings */
+	for (va = newtop; va < oldtop; va += PAGE_SIZE) {
+		pte = as_pte(as, va);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		if (PTE_ISSWAP(*pte)) {
+			swap_slot_decref(PTE_SLOT(*pte), false);
+		}
+		else {
+			page_decref(*pte);
+			unmapped = true;
+		}
+		*pte = 0;
+	}
+	if (unmapped) {
+		asid_retire(as);
+	}
+
+	/* new pages are zero-filled by vm_fault on first touch */
+	heap->r_npages = (newtop - heap->r_vbase) / PAGE_SIZE;
+	*oldbreak = as->as_heap_end;
+	as->as_heap_end = newend;
+	lock_release(as->as_lock);
+	return 0;
+}
+
+/*
+ * Share every page that is loaded in src with dst, copy-on-write.
+ * Pages that were never touched stay unloaded in both.
+ */
+static
+void
+as_share_pt(paddr_t *dst, const paddr_t *src, size_t npages)
+{
+	for (size_t i=0; i<npages; ++i) {
+		if (PTE_ISSWAP(src[i])) {
+			swap_slot_incref(PTE_SLOT(src[i]));
+			dst[i] = src[i];
+		}
+		else if (src[i] != 0) {
+			page_incref(src[i]);
+			dst[i] = src[i];
+		}
+	}
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	#if OPT_A3
+	struct region *r, *nr;
+	int result;
+	#endif
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
+	#if OPT_A3
+	for (r = old->as_regions; r != NULL; r = r->r_next) {
+		result = as_region_add(new, r->r_vbase, r->r_npages,
+				       r->r_readable, r->r_writeable,
+				       r->r_executable, &nr);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		nr->r_file_vaddr = r->r_file_vaddr;
+		nr->r_file_offset = r->r_file_offset;
+		nr->r_file_size = r->r_file_size;
+		if (r == old->as_heap) {
+			new->as_heap = nr;
+		}
+		if (r == old->as_stack) {
+			new->as_stack = nr;
+		}
+	}
+
+	new->as_heap_end = old->as_heap_end;
+	new->complete_load_elf = old->complete_load_elf;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	lock_acquire(old->as_lock);
+	for (unsigned d=0; d<PT_NDIR; ++d) {
+		if (old->as_pt[d] == NULL) {
+			continue;
+		}
+		new->as_pt[d] = as_create_pt();
+		if (new->as_pt[d] == NULL) {
+			lock_release(old->as_lock);
+			as_destroy(new);
+			return ENOMEM;
+		}
+		as_share_pt(new->as_pt[d], old->as_pt[d], PT_NENT);
+	}
+
+	/*
+	 * old is the current process's address space (we are in
+	 * fork), and its TLB entries for what are now shared pages may
+	 * still be writeable. Retire them so its next write faults too.
+	 */
+	asid_retire(old);
+	lock_release(old->as_lock);
+
+	#else
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
-	#if OPT_A3
-	new->as_pt1_readable = old->as_pt1_readable;
-    new->as_pt1_writeable = old->as_pt1_writeable;
-    new->as_pt1_executable = old->as_pt1_executable;
-    
-    new->as_pt2_readable   = old->as_pt2_readable;
-    new->as_pt2_writeable  = old->as_pt2_writeable;
-    new->as_pt2_executable = old->as_pt2_executable;
-	#endif
-
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
@@ -666,24 +2361,6 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
 
-	#if OPT_A3
-	for (size_t i=0; i<new->as_npages1; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(new->as_pt1[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pt1[i]),
-                    old->as_npages1*PAGE_SIZE);
-	}
-	for (size_t i=0; i<new->as_npages2; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(new->as_pt2[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pt2[i]),
-                    old->as_npages2*PAGE_SIZE);
-	}
-	for (size_t i=0; i<DUMBVM_STACKPAGES; ++i) {
-		memmove((void *)PADDR_TO_KVADDR(new->as_stack_pt[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_stack_pt[i]),
-                    DUMBVM_STACKPAGES*PAGE_SIZE);
-	}
-
-	#else
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
@@ -695,6 +2372,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+	#endif
 	
 	*ret = new;
 	return 0;
@@ -376,6 +376,8 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_close = con_close;
 	dev->d_io = con_io;
 	dev->d_ioctl = con_ioctl;
+	dev->d_submit = NULL;
+	dev->d_printstats = NULL;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
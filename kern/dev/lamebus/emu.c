@@ -479,11 +479,21 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/*
+	 * Someone may have picked the vnode up again from our table
+	 * since VOP_DECREF decided to reclaim it.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -1153,7 +1163,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * e_lock covers ef_vnodes too; emufs_reclaim holds it while
+	 * removing from the array. Don't take the big lock here, as
+	 * vfs_getroot calls us with the device table read-locked.
+	 */
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1166,7 +1180,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1187,7 +1200,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1197,13 +1209,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1295,6 +1305,8 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	ef->ef_fs.fs_getvolname = emufs_getvolname;
 	ef->ef_fs.fs_getroot = emufs_getroot;
 	ef->ef_fs.fs_unmount = emufs_unmount;
+	/* the host may change files behind our back */
+	ef->ef_fs.fs_namecache = false;
 	ef->ef_fs.fs_data = ef;
 
 	ef->ef_emu = sc;
@@ -29,13 +29,26 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The card transfers one sector per command through its on-card
+ * buffer. Requests (struct devreq) are queued in sector order and
+ * served C-LOOK: upward from the last sector transferred, then back
+ * around to the lowest. A request that continues another waiting
+ * one in the same direction is merged into its run, and the run is
+ * served as a unit. The interrupt handler copies each sector, starts
+ * the next, and calls a finished request's dr_done.
+ *
+ * lhd_io, the ordinary d_io entry point, queues a request and waits
+ * for it.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -94,44 +107,321 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Request queue. Everything here is called with lh_lock held.
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Put a request in the queue, merging it into a waiting run of the
+ * same direction that it continues or that continues it.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_enqueue(struct lhd_softc *lh, struct devreq *dr)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq **pp, *q, *tail;
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		q = *pp;
+		if (q->dr_write == dr->dr_write) {
+			for (tail = q; tail->dr_merged != NULL;
+			     tail = tail->dr_merged) {
+				/* nothing */
+			}
+			if (tail->dr_block + tail->dr_nblocks == dr->dr_block) {
+				/* goes at the end of q's run */
+				tail->dr_merged = dr;
+				lh->lh_nmerged++;
+				return;
+			}
+			if (dr->dr_block + dr->dr_nblocks == q->dr_block) {
+				/* goes in front; take q's place */
+				dr->dr_merged = q;
+				dr->dr_next = q->dr_next;
+				q->dr_next = NULL;
+				*pp = dr;
+				lh->lh_nmerged++;
+				return;
+			}
+		}
+		if (q->dr_block > dr->dr_block) {
+			break;
+		}
+	}
+	dr->dr_next = *pp;
+	*pp = dr;
+}
+
+/*
+ * Take the next run off the queue: the first one at or past the last
+ * sector transferred, or if there is none, the lowest.
+ */
+static
+struct devreq *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct devreq **pp, *dr;
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((*pp)->dr_block >= lh->lh_head) {
+			break;
+		}
+	}
+	if (*pp == NULL) {
+		pp = &lh->lh_queue;
+		if (*pp == NULL) {
+			return NULL;
+		}
+	}
+	dr = *pp;
+	*pp = dr->dr_next;
+	dr->dr_next = NULL;
+
+	if (dr->dr_block > lh->lh_head) {
+		lh->lh_seeksum += dr->dr_block - lh->lh_head;
+	}
+	else {
+		lh->lh_seeksum += lh->lh_head - dr->dr_block;
+	}
+	lh->lh_run = dr->dr_merged;
+	return dr;
+}
+
+/*
+ * Start the card on the next sector of lh_cur, picking a new run
+ * first if lh_cur is done.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct devreq *dr;
+	uint32_t statval = LHD_WORKING;
+
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = lhd_pick(lh);
+		if (lh->lh_cur == NULL) {
+			/* nothing to do; go idle */
+			return;
+		}
+	}
+	dr = lh->lh_cur;
+
+	/* Are we writing? If so, fill the on-card buffer. */
+	if (dr->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)dr->dr_data + dr->dr_xfered * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, dr->dr_block + dr->dr_xfered);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * lh_cur is finished; account for it and move on to the rest of its
+ * run. Its dr_done is left to the caller, to call unlocked.
+ */
+static
+void
+lhd_finish(struct lhd_softc *lh)
+{
+	struct devreq *dr = lh->lh_cur;
+	time_t secs;
+	uint32_t nsecs, svc;
+
+	gettime(&secs, &nsecs);
+	getinterval(dr->dr_qsecs, dr->dr_qnsecs, secs, nsecs, &secs, &nsecs);
+	svc = secs * 1000000000 + nsecs;
+
+	lh->lh_nreqs++;
+	lh->lh_svcnsecs += svc;
+	if (svc > lh->lh_maxsvcnsecs) {
+		lh->lh_maxsvcnsecs = svc;
+	}
+	KASSERT(lh->lh_depth > 0);
+	lh->lh_depth--;
+
+	lh->lh_cur = lh->lh_run;
+	if (lh->lh_run != NULL) {
+		lh->lh_run = lh->lh_run->dr_merged;
+	}
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, finish the sector, and start the next one.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *dr, *done = NULL;
 	uint32_t val;
+	int err = 0;
 	
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
 	    case LHD_IDLE:
 	    case LHD_WORKING:
-		break;
+		spinlock_release(&lh->lh_lock);
+		return;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		err = lhd_code_to_errno(lh, val);
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	dr = lh->lh_cur;
+	if (dr == NULL) {
+		/* nothing was running */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0) {
+		/* Are we reading? If so, empty the on-card buffer. */
+		if (!dr->dr_write) {
+			memcpy((char *)dr->dr_data +
+			       dr->dr_xfered * LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		lh->lh_head = dr->dr_block + dr->dr_xfered;
+		dr->dr_xfered++;
+	}
+	if (err != 0 || dr->dr_xfered == dr->dr_nblocks) {
+		lhd_finish(lh);
+		done = dr;
+	}
+
+	lhd_start(lh);
+
+	spinlock_release(&lh->lh_lock);
+
+	if (done != NULL) {
+		done->dr_done(done, err);
 	}
 }
 
+/*
+ * Queue an asynchronous request. (d_submit)
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *dr)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (dr->dr_nblocks == 0 || dr->dr_block >= lh->lh_dev.d_blocks ||
+	    dr->dr_nblocks > lh->lh_dev.d_blocks - dr->dr_block) {
+		return EINVAL;
+	}
+
+	dr->dr_next = NULL;
+	dr->dr_merged = NULL;
+	dr->dr_xfered = 0;
+	gettime(&dr->dr_qsecs, &dr->dr_qnsecs);
+
+	spinlock_acquire(&lh->lh_lock);
+
+	lh->lh_depth++;
+	lh->lh_depthsum += lh->lh_depth;
+	if (lh->lh_depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = lh->lh_depth;
+	}
+
+	lhd_enqueue(lh, dr);
+	if (lh->lh_cur == NULL) {
+		/* the card is idle */
+		lhd_start(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Synchronous I/O
+
+/* What a thread in lhd_io waits on. */
+struct lhd_waiter {
+	struct lhd_softc *lw_lh;
+	bool lw_done;
+	int lw_result;
+};
+
+/* dr_done for lhd_io's requests. */
+static
+void
+lhd_wakeup(struct devreq *dr, int result)
+{
+	struct lhd_waiter *lw = dr->dr_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_result = result;
+	lw->lw_done = true;
+	wchan_wakeall(lh->lh_wchan);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Transfer NSECT sectors starting at SECTOR to or from DATA, and wait
+ * for it to finish.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+       bool write, void *data)
+{
+	struct devreq dr;
+	struct lhd_waiter lw;
+	int result;
+
+	lw.lw_lh = lh;
+	lw.lw_done = false;
+	lw.lw_result = 0;
+
+	dr.dr_block = sector;
+	dr.dr_nblocks = nsect;
+	dr.dr_write = write;
+	dr.dr_data = data;
+	dr.dr_done = lhd_wakeup;
+	dr.dr_arg = &lw;
+
+	result = lhd_submit(&lh->lh_dev, &dr);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!lw.lw_done) {
+		/* as in P(): wchan_sleep unlocks the wchan */
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lw.lw_result;
+}
+
 /*
  * Function called when we are open()'d.
  */
@@ -206,8 +496,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+	bool write = (uio->uio_rw == UIO_WRITE);
+	struct iovec *iov;
+	char buf[LHD_SECTSIZE];
 	uint32_t i;
-	uint32_t statval = LHD_WORKING;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,61 +512,88 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	/*
+	 * A single kernel buffer (the buffer cache, swap) is transferred
+	 * in place as one request.
+	 */
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		result = lhd_rw(lh, sector, len, write, iov->iov_kbase);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	/* Anything else goes a sector at a time through BUF. */
+	for (i=0; i<len; i++) {
+		if (write) {
+			result = uiomove(buf, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
 				return result;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_rw(lh, sector+i, 1, write, buf);
 		if (result) {
 			return result;
 		}
+
+		if (!write) {
+			result = uiomove(buf, LHD_SECTSIZE, uio);
+			if (result) {
+				return result;
+			}
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Print the queue statistics. (d_printstats)
+ */
+static
+void
+lhd_printstats(struct device *d)
+{
+	struct lhd_softc *lh = d->d_data;
+	unsigned nreqs, nmerged, maxdepth;
+	uint64_t depthsum, seeksum, svcnsecs;
+	uint32_t maxsvc;
+
+	spinlock_acquire(&lh->lh_lock);
+	nreqs = lh->lh_nreqs;
+	nmerged = lh->lh_nmerged;
+	maxdepth = lh->lh_maxdepth;
+	depthsum = lh->lh_depthsum;
+	seeksum = lh->lh_seeksum;
+	svcnsecs = lh->lh_svcnsecs;
+	maxsvc = lh->lh_maxsvcnsecs;
+	spinlock_release(&lh->lh_lock);
+
+	kprintf("lhd%d: %u requests, %u merged into runs\n",
+		lh->lh_unit, nreqs, nmerged);
+	if (nreqs == 0) {
+		return;
+	}
+	kprintf("    queue depth: avg %u, max %u\n",
+		(unsigned)(depthsum / nreqs), maxdepth);
+	kprintf("    seek: avg %u sectors per request\n",
+		(unsigned)(seeksum / nreqs));
+	kprintf("    service time: avg %u us, max %u us\n",
+		(unsigned)(svcnsecs / nreqs / 1000), maxsvc / 1000);
+}
+
 /*
  * Setup routine called by autoconf.c when an lhd is found.
  */
@@ -289,23 +608,34 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_run = NULL;
+	lh->lh_head = 0;
+	lh->lh_depth = 0;
+
+	lh->lh_nreqs = 0;
+	lh->lh_nmerged = 0;
+	lh->lh_maxdepth = 0;
+	lh->lh_depthsum = 0;
+	lh->lh_seeksum = 0;
+	lh->lh_svcnsecs = 0;
+	lh->lh_maxsvcnsecs = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
+	lh->lh_dev.d_printstats = lhd_printstats;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
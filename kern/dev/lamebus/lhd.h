@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,22 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the rest, and the card */
+	struct wchan *lh_wchan;		/* Threads waiting in lhd_io */
+	struct devreq *lh_queue;	/* Waiting runs, by sector */
+	struct devreq *lh_cur;		/* Request the card is working on */
+	struct devreq *lh_run;		/* Rest of lh_cur's run */
+	uint32_t lh_head;		/* Last sector transferred */
+	unsigned lh_depth;		/* Requests queued or in progress */
+
+	/* Statistics, also under lh_lock */
+	unsigned lh_nreqs;		/* requests completed */
+	unsigned lh_nmerged;		/* ...that were merged into a run */
+	unsigned lh_maxdepth;
+	uint64_t lh_depthsum;		/* lh_depth seen by each arrival */
+	uint64_t lh_seeksum;		/* sectors moved between runs */
+	uint64_t lh_svcnsecs;		/* queue to completion, summed */
+	uint32_t lh_maxsvcnsecs;
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -111,11 +113,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	struct vnode **vs;
+	unsigned i, b, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +150,46 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Go over the table of loaded vnodes, inactive ones included,
+	 * putting changed inodes in the buffer cache; the buffer_sync
+	 * at the end writes them and the data out together.
+	 * sfs_writeinode takes each vnode's lock, which comes before
+	 * the table lock, so take references to them all under the
+	 * table lock and write them after letting go of it.
+	 */
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	vs = kmalloc(num * sizeof(struct vnode *));
+	if (vs == NULL && num > 0) {
+		rwlock_release_read(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	i = 0;
+	for (b=0; b<SFS_VNHASHSIZE; b++) {
+		for (sv = sfs->sfs_vnhash[b]; sv != NULL; sv = sv->sv_hashnext) {
+			KASSERT(i < num);
+			vs[i] = &sv->sv_v;
+			VOP_INCREF(vs[i]);
+			i++;
+		}
+	}
+	KASSERT(i == num);
+	rwlock_release_read(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sfs_writeinode(vs[i]);
+		VOP_DECREF(vs[i]);
 	}
+	kfree(vs);
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,33 +199,32 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Everything above only went as far as the buffer cache. */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The name is fixed at mount time, so no lock is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,31 +237,48 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
+
+	/*
+	 * The vfs layer holds its big lock and has the device table
+	 * locked across this, so nobody can find the filesystem to
+	 * start using it again behind our back.
+	 */
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* Let go of vnodes we were only keeping around in case of reuse */
+	result = sfs_flushinactive(sfs);
+	if (result) {
+		return result;
+	}
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(sfs->sfs_vnlock);
 	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	if (sfs->sfs_nvnodes > 0) {
+		rwlock_release_read(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
+	rwlock_release_read(sfs->sfs_vnlock);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs->sfs_groupfree);
 	bitmap_destroy(sfs->sfs_freemap);
+	rwlock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
-	/* The vfs layer takes care of the device for us */
-	(void)sfs->sfs_device;
+	/* Drop its cached blocks; the vfs layer takes care of the device */
+	buffer_purge(sfs->sfs_device);
 
 	/* Destroy the fs object */
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -254,11 +300,10 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
+	unsigned i;
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -278,22 +323,33 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Empty vnode table */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_ninactive = 0;
+
+	/* and the locks */
+	sfs->sfs_vnlock = rwlock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		rwlock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -303,9 +359,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		rwlock_destroy(sfs->sfs_vnlock);
+		buffer_purge(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +373,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		rwlock_destroy(sfs->sfs_vnlock);
+		buffer_purge(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,25 +391,49 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		rwlock_destroy(sfs->sfs_vnlock);
+		buffer_purge(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		rwlock_destroy(sfs->sfs_vnlock);
+		buffer_purge(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Count the free blocks in each allocation group */
+	sfs->sfs_ngroups = DIVROUNDUP(sfs->sfs_super.sp_nblocks,
+				      SFS_GROUPBLOCKS);
+	sfs->sfs_groupfree = kmalloc(sfs->sfs_ngroups * sizeof(unsigned));
+	if (sfs->sfs_groupfree == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		lock_destroy(sfs->sfs_freemaplock);
+		rwlock_destroy(sfs->sfs_vnlock);
+		buffer_purge(dev);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_ngroups; i++) {
+		sfs->sfs_groupfree[i] = 0;
+	}
+	for (i=0; i<sfs->sfs_super.sp_nblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			sfs->sfs_groupfree[i / SFS_GROUPBLOCKS]++;
+		}
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
 	sfs->sfs_absfs.fs_getroot = sfs_getroot;
 	sfs->sfs_absfs.fs_unmount = sfs_unmount;
+	sfs->sfs_absfs.fs_namecache = true;
 	sfs->sfs_absfs.fs_data = sfs;
 
 	/* the other fields */
@@ -361,7 +443,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
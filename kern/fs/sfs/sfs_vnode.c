@@ -43,12 +43,26 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
+/* With sfs_loadvnode */
+static void sfs_deactivate(struct sfs_fs *sfs, struct sfs_vnode *sv);
+static void sfs_unhash(struct sfs_fs *sfs, struct sfs_vnode *sv);
+
+/* Statistics, across all filesystems; printed by sfs_printstats */
+static struct spinlock sfs_statlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_vnhits, sfs_vninactivehits, sfs_vnmisses, sfs_vnevicts;
+static unsigned sfs_raseq, sfs_rarandom, sfs_raissued;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -63,7 +77,10 @@ sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 	return sfs_wblock(sfs, zeros, block);
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out to disk. The caller
+ * holds sv_lock, or is reclaiming the vnode.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -84,19 +101,27 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, as close after GOAL as possible: GOAL itself if
+ * it's free, else the rest of its group, else the groups after it.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
+	if (*diskblock < sfs->sfs_super.sp_nblocks) {
+		KASSERT(sfs->sfs_groupfree[*diskblock / SFS_GROUPBLOCKS] > 0);
+		sfs->sfs_groupfree[*diskblock / SFS_GROUPBLOCKS]--;
+	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -113,8 +138,46 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	/*
+	 * Whatever is cached for it needn't ever be written. Do this
+	 * first: once it's unmarked, sfs_balloc may hand it out and
+	 * clear it in the cache for its new owner.
+	 */
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_groupfree[diskblock / SFS_GROUPBLOCKS]++;
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Pick a fresh group for a file that's outgrowing the one it's in:
+ * the one with the most free blocks, preferring the groups just
+ * after NEAR's. Returns the group's first block.
+ */
+static
+uint32_t
+sfs_newgroup(struct sfs_fs *sfs, uint32_t near)
+{
+	unsigned i, g, best, start;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	start = near / SFS_GROUPBLOCKS;
+	best = start;
+	for (i=1; i<sfs->sfs_ngroups; i++) {
+		g = (start + i) % sfs->sfs_ngroups;
+		if (sfs->sfs_groupfree[g] > sfs->sfs_groupfree[best]) {
+			best = g;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (best == start) {
+		return near;
+	}
+	return best * SFS_GROUPBLOCKS;
 }
 
 /*
@@ -124,44 +187,69 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Number of file blocks mapped by an indirect block of the given level
+ * (1 for single indirect, 2 for double, 3 for triple).
+ */
+static
+uint32_t
+sfs_idspan(unsigned level)
+{
+	uint32_t span = 1;
+
+	while (level-- > 0) {
+		span *= SFS_DBPERIDB;
+	}
+	return span;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated. The caller holds sv_lock.
+ *
+ * Past the direct blocks come the blocks mapped by the indirect
+ * block, then the double indirect block, then the triple indirect
+ * block. The last single indirect block used is remembered in the
+ * vnode, so a sequential pass over a big file only has to look at
+ * one indirect block per SFS_DBPERIDB blocks rather than walk the
+ * whole tree for each block.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t *topptr;
+	uint32_t block, goal;
+	uint32_t idblock, idbase, span;
+	uint32_t idoff;
+	unsigned level;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +264,16 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			/* Try to follow on from the previous block */
+			if (fileblock > 0 &&
+			    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+				goal = sv->sv_i.sfi_direct[fileblock-1] + 1;
+			}
+			else {
+				goal = sv->sv_ino + 1;
+			}
+
+			result = sfs_balloc(sfs, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -184,6 +281,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
 			sv->sv_dirty = true;
+			sv->sv_nextgoal = block + 1;
 		}
 
 		/*
@@ -198,90 +296,138 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * If the last single indirect block we went through covers
+	 * this block too, go straight there.
 	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
-		return EFBIG;
+	if (sv->sv_leafblock != 0 && fileblock >= sv->sv_leafbase &&
+	    fileblock - sv->sv_leafbase < SFS_DBPERIDB) {
+		idblock = sv->sv_leafblock;
+		idbase = sv->sv_leafbase;
+		level = 1;
 	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
+	else {
 		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * Work out which tree the block is in, and where the
+		 * tree starts.
 		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+		idbase = SFS_NDIRECT;
+		level = 1;
+		topptr = &sv->sv_i.sfi_indirect;
+		if (fileblock - idbase >= sfs_idspan(1)) {
+			idbase += sfs_idspan(1);
+			level = 2;
+			topptr = &sv->sv_i.sfi_dindirect;
+		}
+		if (level == 2 && fileblock - idbase >= sfs_idspan(2)) {
+			idbase += sfs_idspan(2);
+			level = 3;
+			topptr = &sv->sv_i.sfi_tindirect;
+		}
+		if (level == 3 && fileblock - idbase >= sfs_idspan(3)) {
+			return EFBIG;
 		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		/* Get the disk block number of the top indirect block. */
+		idblock = *topptr;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+		if (idblock==0 && !doalloc) {
+			/*
+			 * There's no indirect block allocated. We weren't
+			 * asked to allocate anything, so pretend the
+			 * indirect block was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		else if (idblock==0) {
+			/*
+			 * There's no indirect block allocated, but we
+			 * need to allocate a block whose number needs to
+			 * be stored in it, so allocate it. The file is
+			 * getting big, so start it in a new group; the
+			 * blocks it points to will follow on from it.
+			 */
+			goal = sfs_newgroup(sfs, sv->sv_nextgoal != 0 ?
+					    sv->sv_nextgoal : sv->sv_ino);
+			result = sfs_balloc(sfs, goal, &idblock);
+			if (result) {
+				return result;
+			}
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+			/* Remember the block we just allocated */
+			*topptr = idblock;
+
+			/* Mark the inode dirty */
+			sv->sv_dirty = true;
+			sv->sv_nextgoal = idblock + 1;
 		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down the tree. At each level, get the indirect block
+	 * from the buffer cache (a new one was cleared there by
+	 * sfs_balloc) and pick out the entry that leads to FILEBLOCK.
+	 */
+	for (; level > 0; level--) {
+		span = sfs_idspan(level - 1);
+		idoff = (fileblock - idbase) / span;
+		KASSERT(idoff < SFS_DBPERIDB);
+
+		if (level == 1) {
+			sv->sv_leafbase = idbase;
+			sv->sv_leafblock = idblock;
+		}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		idptrs = buffer_map(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the next block out of the indirect block buffer */
+		block = idptrs[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			if (level == 1 && idoff > 0 && idptrs[idoff-1] != 0) {
+				goal = idptrs[idoff-1] + 1;
+			}
+			else if (sv->sv_nextgoal != 0) {
+				goal = sv->sv_nextgoal;
+			}
+			else {
+				goal = idblock + 1;
+			}
+
+			result = sfs_balloc(sfs, goal, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			idptrs[idoff] = block;
+			sv->sv_nextgoal = block + 1;
+
+			/* The indirect block is now dirty */
+			buffer_mark_dirty(idbuf);
 		}
+		buffer_release(idbuf);
+
+		if (block == 0) {
+			/* Nothing mapped here, and we weren't to allocate */
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
+		}
+
+		idblock = block;
+		idbase += idoff * span;
 	}
 
 	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
+	block = idblock;
+	if (!sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
 	}
@@ -308,16 +454,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +477,31 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * A write is written back from the cache later.
 	 */
+	result = uiomove((char *)buffer_map(iobuf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		/* even if it failed partway */
+		buffer_mark_dirty(iobuf);
 	}
-
-	return 0;
+	buffer_release(iobuf);
+	return result;
 }
 
 /*
@@ -383,14 +512,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,35 +539,114 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. A write replaces the whole
+	 * block, so there's no need to read it first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		/* even if it failed partway */
+		buffer_mark_dirty(iobuf);
+	}
+	buffer_release(iobuf);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/* Read-ahead window, in blocks */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 32
 
-	return result;
+/*
+ * Read-ahead. Each vnode remembers where the last read ended; a read
+ * that starts there is sequential, and grows the read-ahead window,
+ * while one that starts anywhere else shrinks it. The blocks of the
+ * read itself after the first, and the window's worth of blocks
+ * after those, are handed to buffer_readahead, which queues them all
+ * with the disk at once; by the time sfs_blockio asks for them they
+ * are in the cache or on their way. The caller holds sv_lock.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t offset, size_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, last, from, to, fileblock, diskblock;
+	unsigned issued;
+	bool sequential, random;
+
+	KASSERT(len > 0);
+	first = offset / SFS_BLOCKSIZE;
+	last = (offset + len - 1) / SFS_BLOCKSIZE;
+
+	sequential = random = false;
+	if (first == sv->sv_ranext) {
+		/* picks up where the last read left off */
+		sequential = true;
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else if (first + 1 == sv->sv_ranext) {
+		/* more of the block the last read ended in */
+	}
+	else {
+		random = true;
+		sv->sv_rawindow /= 2;
+		sv->sv_rahead = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	/* The first block is about to be read anyway */
+	from = first + 1;
+	if (from < sv->sv_rahead) {
+		from = sv->sv_rahead;
+	}
+	to = last + 1 + sv->sv_rawindow;
+	if (to > DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+		to = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	}
+
+	issued = 0;
+	for (fileblock = from; fileblock < to; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock) != 0) {
+			break;
+		}
+		if (diskblock != 0 &&
+		    buffer_readahead(sfs->sfs_device, diskblock)) {
+			issued++;
+		}
+	}
+	if (to > sv->sv_rahead) {
+		sv->sv_rahead = to;
+	}
+
+	spinlock_acquire(&sfs_statlock);
+	if (sequential) {
+		sfs_raseq++;
+	}
+	if (random) {
+		sfs_rarandom++;
+	}
+	sfs_raissued += issued;
+	spinlock_release(&sfs_statlock);
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The caller holds sv_lock.
  */
 static
 int
@@ -471,6 +676,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio->uio_offset, uio->uio_resid);
+		}
 	}
 
 	/*
@@ -545,40 +754,6 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 //
 // Directory I/O
 
-/*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
- */
-static
-int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
-{
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
-
-	/* do it */
-	result = sfs_io(sv, &ku);
-	if (result) {
-		return result;
-	}
-
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
-	}
-
-	/* Done */
-	return 0;
-}
-
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
  * vnode.
@@ -640,6 +815,9 @@ sfs_dir_nentries(struct sfs_vnode *sv)
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * This reads the directory a block at a time straight out of the
+ * buffer cache, rather than a slot at a time through sfs_io.
  */
 
 static
@@ -647,26 +825,47 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	const int perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
 	struct sfs_dir tsd;
+	struct buf *b;
+	struct sfs_dir *sds;
+	uint32_t diskblock;
 	int found = 0;
 	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	int i, j, result;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	/* For each block of slots... */
+	for (i=0; i<nentries; i+=perblock) {
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
+		result = sfs_bmap(sv, i / perblock, 0, &diskblock);
 		if (result) {
 			return result;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
+		if (diskblock == 0) {
+			/* Never written; reads as zeros, i.e. free slots */
 			if (emptyslot != NULL) {
 				*emptyslot = i;
 			}
+			continue;
 		}
-		else {
+		result = buffer_read(sfs->sfs_device, diskblock, &b);
+		if (result) {
+			return result;
+		}
+		sds = buffer_map(b);
+
+		/* ...and each slot in it */
+		for (j=0; j<perblock && i+j<nentries; j++) {
+			tsd = sds[j];
+			if (tsd.sfd_ino == SFS_NOINO) {
+				/* Free slot - report it back if requested */
+				if (emptyslot != NULL) {
+					*emptyslot = i+j;
+				}
+				continue;
+			}
+
 			/* Ensure null termination, just in case */
 			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
 			if (!strcmp(tsd.sfd_name, name)) {
@@ -676,13 +875,15 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 
 				found = 1;
 				if (slot != NULL) {
-					*slot = i;
+					*slot = i+j;
 				}
 				if (ino != NULL) {
 					*ino = tsd.sfd_ino;
 				}
 			}
 		}
+
+		buffer_release(b);
 	}
 
 	return found ? 0 : ENOENT;
@@ -752,7 +953,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The caller holds the directory's sv_lock.
  */
 static
 int
@@ -791,17 +992,19 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t near,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * near NEAR, the directory it's going in.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, near, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1078,11 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	/*
+	 * Just the inode; the data goes out with the rest of the
+	 * buffer cache on sync or eviction.
+	 */
+	return sfs_writeinode(v);
 }
 
 /*
@@ -890,69 +1096,76 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Hold the vnode table lock throughout, so sfs_loadvnode can
+	 * neither find the vnode while we tear it down nor load a
+	 * second copy of the inode before this one is written back.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	/*
+	 * Ours was the last reference and the table lock keeps anyone
+	 * from making another, so nobody else can hold sv_lock and we
+	 * needn't take it.
+	 */
+	KASSERT(!sv->sv_inactive);
+
+	/*
+	 * If the file still exists on disk, keep the vnode around in
+	 * case it's wanted again soon. The reference we were called
+	 * with passes to the inactive list.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		sfs_deactivate(sfs, sv);
+		rwlock_release_write(sfs->sfs_vnlock);
+		return 0;
+	}
+
+	/* There are no on-disk references to the file either; erase it. */
+	result = sfs_dotruncate(sv, 0);
+	if (result) {
+		rwlock_release_write(sfs->sfs_vnlock);
+		return result;
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_unhash(sfs, sv);
 
-	VOP_CLEANUP(&sv->sv_v);
+	rwlock_release_write(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	VOP_CLEANUP(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -971,9 +1184,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1203,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1246,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1046,6 +1261,8 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so no lock.
  */
 static
 int
@@ -1053,16 +1270,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1098,14 +1311,35 @@ sfs_tryseek(struct vnode *v, off_t pos)
 static
 int
 sfs_fsync(struct vnode *v)
+{
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	result = sfs_writeinode(v);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * The file's data may be sitting dirty in the cache. Buffers
+	 * don't record which file they belong to, so write back the
+	 * whole device.
+	 */
+	return buffer_sync(sfs->sfs_device);
+}
+
+/*
+ * Write the vnode's inode into the buffer cache, if it has changed.
+ */
+int
+sfs_writeinode(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
-
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1121,35 +1355,93 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks past BLOCKLEN in the tree under the indirect block
+ * *IDBLOCKP, which is of the given level and maps file blocks from
+ * BASEBLOCK on. If that empties it, free it too, zero *IDBLOCKP and
+ * set *CHANGED.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncindirect(struct sfs_fs *sfs, uint32_t *idblockp, unsigned level,
+		  uint32_t baseblock, uint32_t blocklen, bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t j, span;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	if (*idblockp == 0 || blocklen >= baseblock + sfs_idspan(level)) {
+		/* Nothing here, or nothing here past the new EOF */
+		return 0;
+	}
+
+	/* Get the indirect block from the buffer cache */
+	result = buffer_read(sfs->sfs_device, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = buffer_map(idbuf);
+
+	span = sfs_idspan(level - 1);
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (level > 1) {
+			result = sfs_truncindirect(sfs, &idptrs[j], level - 1,
+						   baseblock + j*span,
+						   blocklen, &iddirty);
+			if (result) {
+				if (iddirty) {
+					buffer_mark_dirty(idbuf);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		/* Discard any blocks that are past the new EOF */
+		else if (blocklen <= baseblock+j && idptrs[j] != 0) {
+			sfs_bfree(sfs, idptrs[j]);
+			idptrs[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptrs[j]!=0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*changed = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Truncate a file to LEN bytes. The caller holds sv_lock, or is
+ * reclaiming the vnode.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block;
+	uint32_t baseblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +1456,26 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/* Then the indirect trees. The remembered one may go away. */
+	sv->sv_leafblock = 0;
+	sv->sv_rahead = 0;
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	result = sfs_truncindirect(sfs, &sv->sv_i.sfi_indirect, 1,
+				   baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	baseblock += sfs_idspan(1);
+	result = sfs_truncindirect(sfs, &sv->sv_i.sfi_dindirect, 2,
+				   baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
+	}
+	baseblock += sfs_idspan(2);
+	result = sfs_truncindirect(sfs, &sv->sv_i.sfi_tindirect, 3,
+				   baseblock, blocklen, &sv->sv_dirty);
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -1220,10 +1484,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +1539,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +1558,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +1580,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	namecache_remove(&sv->sv_v, name);
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +1614,31 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/*
+	 * No links to directories. Besides making loops, a link to
+	 * the directory in itself would have lookups lock it twice.
+	 */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EPERM;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	namecache_remove(dir, name);
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,28 +1654,32 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
+		namecache_remove(dir, name);
+
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1401,15 +1699,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +1728,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +1743,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	namecache_remove(d1, n1);
+	namecache_remove(d2, n2);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
@@ -1464,11 +1769,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1486,15 +1793,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +1805,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +1822,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1642,51 +1941,311 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+////////////////////////////////////////////////////////////
+//
+// Vnode table
+
+/*
+ * Loaded vnodes are hashed by inode number. When the last reference
+ * to a vnode that still has a link on disk goes away, sfs_reclaim
+ * doesn't free it but moves it to the inactive list, still holding
+ * the one reference it was called with, so that reopening a file
+ * that was just closed (executing the same program over and over,
+ * say) needn't read the inode back in. The inactive list is kept
+ * in LRU order, and is trimmed from the old end when it grows past
+ * SFS_MAXINACTIVE or when we run out of memory loading a vnode.
+ *
+ * All of this is under sfs_vnlock, held for writing, except that
+ * sfs_loadvnode can hand out a vnode that's in use holding it only
+ * for reading.
+ */
+
+/* How many unreferenced vnodes to keep per filesystem */
+#define SFS_MAXINACTIVE 128
+
+static
+unsigned
+sfs_vnhashfunc(uint32_t ino)
+{
+	return ino % SFS_VNHASHSIZE;
+}
+
+static
+void
+sfs_unhash(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p;
+
+	for (p = &sfs->sfs_vnhash[sfs_vnhashfunc(sv->sv_ino)];
+	     *p != NULL; p = &(*p)->sv_hashnext) {
+		if (*p == sv) {
+			*p = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			KASSERT(sfs->sfs_nvnodes > 0);
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: vnode %u not in vnode table\n", sv->sv_ino);
+}
+
+/*
+ * Take a vnode off the inactive list.
+ */
+static
+void
+sfs_lruremove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_inactive);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_inactive = false;
+	KASSERT(sfs->sfs_ninactive > 0);
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Write back and free the least recently used inactive vnode that
+ * nobody has borrowed. (sfs_sync takes references to all the vnodes
+ * in the table, inactive ones included, while it works.) Returns
+ * ENOENT if there's nothing to evict.
+ */
+static
+int
+sfs_evict(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	bool busy;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_lrutail; sv != NULL; sv = sv->sv_lruprev) {
+		spinlock_acquire(&sv->sv_v.vn_countlock);
+		busy = sv->sv_v.vn_refcount != 1;
+		spinlock_release(&sv->sv_v.vn_countlock);
+		if (!busy) {
+			break;
+		}
+	}
+	if (sv == NULL) {
+		return ENOENT;
+	}
+
+	/* Nobody can reach it without the table lock; no need for sv_lock */
+	result = sfs_sync_inode(sv);
+	if (result) {
+		return result;
+	}
+
+	sfs_lruremove(sfs, sv);
+	sfs_unhash(sfs, sv);
+
+	spinlock_acquire(&sfs_statlock);
+	sfs_vnevicts++;
+	spinlock_release(&sfs_statlock);
+
+	VOP_CLEANUP(&sv->sv_v);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+	return 0;
+}
+
+/*
+ * Put a vnode whose last reference just went away on the inactive
+ * list, and trim the list if that made it too long.
+ */
+static
+void
+sfs_deactivate(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_inactive);
+
+	sv->sv_inactive = true;
+	sv->sv_lruprev = NULL;
+	sv->sv_lrunext = sfs->sfs_lruhead;
+	if (sfs->sfs_lruhead != NULL) {
+		sfs->sfs_lruhead->sv_lruprev = sv;
+	}
+	else {
+		sfs->sfs_lrutail = sv;
+	}
+	sfs->sfs_lruhead = sv;
+	sfs->sfs_ninactive++;
+
+	/*
+	 * If eviction fails the vnode just stays in memory a while
+	 * longer; sfs_sync or the next eviction will retry the write.
+	 */
+	if (sfs->sfs_ninactive > SFS_MAXINACTIVE) {
+		(void)sfs_evict(sfs);
+	}
+}
+
+/*
+ * Free all the inactive vnodes. Used at unmount time, after
+ * sfs_sync, so they're all clean by now.
+ */
+int
+sfs_flushinactive(struct sfs_fs *sfs)
+{
+	int result = 0;
+
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	while (sfs->sfs_lruhead != NULL) {
+		result = sfs_evict(sfs);
+		if (result) {
+			break;
+		}
+	}
+	rwlock_release_write(sfs->sfs_vnlock);
+
+	return result == ENOENT ? 0 : result;
+}
+
+/*
+ * Print the inode cache and read-ahead counters.
+ */
+void
+sfs_printstats(void)
+{
+	spinlock_acquire(&sfs_statlock);
+	kprintf("SFS inode cache: %u hits (%u on inactive vnodes), "
+		"%u misses, %u evictions\n",
+		sfs_vnhits, sfs_vninactivehits, sfs_vnmisses, sfs_vnevicts);
+	kprintf("SFS read-ahead: %u sequential reads, %u others, "
+		"%u blocks started\n",
+		sfs_raseq, sfs_rarandom, sfs_raissued);
+	spinlock_release(&sfs_statlock);
+}
+
+/*
+ * Allocate the in-memory parts of a vnode. When memory is short,
+ * give back inactive vnodes until it works or there are none left.
+ */
+static
+struct sfs_vnode *
+sfs_allocvnode(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(rwlock_do_i_hold_write(sfs->sfs_vnlock));
+
+	while (1) {
+		sv = kmalloc(sizeof(struct sfs_vnode));
+		if (sv != NULL) {
+			sv->sv_lock = lock_create("sfs_vnode");
+			if (sv->sv_lock != NULL) {
+				return sv;
+			}
+			kfree(sv);
+		}
+		if (sfs_evict(sfs)) {
+			return NULL;
+		}
+	}
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Takes the vnode table lock itself.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned bucket;
+	bool writing;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Handing out a vnode that's already in use only needs the
+	 * table read-locked. Taking one off the inactive list or
+	 * loading a new one needs it write-locked; then look again,
+	 * as someone may have beaten us to it if we couldn't upgrade.
+	 */
+	writing = false;
+	rwlock_acquire_read(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+ again:
+	/* Look in the vnodes table */
+	bucket = sfs_vnhashfunc(ino);
+	for (sv = sfs->sfs_vnhash[bucket]; sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino != ino) {
+			continue;
+		}
 
 		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
+		if (!sfs_bused(sfs, ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
+			      ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		if (sv->sv_inactive && !writing) {
+			break;
+		}
+
+		spinlock_acquire(&sfs_statlock);
+		sfs_vnhits++;
+		if (sv->sv_inactive) {
+			sfs_vninactivehits++;
+		}
+		spinlock_release(&sfs_statlock);
 
+		if (sv->sv_inactive) {
+			/* Take over the reference the inactive list had */
+			sfs_lruremove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
 		}
+		if (writing) {
+			rwlock_release_write(sfs->sfs_vnlock);
+		}
+		else {
+			rwlock_release_read(sfs->sfs_vnlock);
+		}
+		*ret = sv;
+		return 0;
+	}
+
+	if (!writing) {
+		if (!rwlock_upgrade(sfs->sfs_vnlock)) {
+			rwlock_release_read(sfs->sfs_vnlock);
+			rwlock_acquire_write(sfs->sfs_vnlock);
+		}
+		writing = true;
+		goto again;
 	}
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	spinlock_acquire(&sfs_statlock);
+	sfs_vnmisses++;
+	spinlock_release(&sfs_statlock);
+
+	sv = sfs_allocvnode(sfs);
 	if (sv==NULL) {
+		rwlock_release_write(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +2258,23 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No allocation, mapping or reading history yet */
+	sv->sv_nextgoal = 0;
+	sv->sv_leafbase = 0;
+	sv->sv_leafblock = 0;
+	sv->sv_ranext = 0;
+	sv->sv_rahead = 0;
+	sv->sv_rawindow = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,20 +2305,23 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_inactive = false;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_hashnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	sfs->sfs_nvnodes++;
+
+	rwlock_release_write(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2339,53 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
+
+/*
+ * Report how fragmented a file is: how many blocks it has, and how
+ * many runs of consecutive disk blocks they're in. One run is ideal.
+ */
+int
+sfs_getfrag(struct vnode *v, unsigned *nblocks, unsigned *nextents)
+{
+	struct sfs_vnode *sv;
+	uint32_t fileblock, nfileblocks, diskblock, prev;
+	int result;
+
+	if (v->vn_ops != &sfs_fileops && v->vn_ops != &sfs_dirops) {
+		return EINVAL;
+	}
+	sv = v->vn_data;
+
+	*nblocks = 0;
+	*nextents = 0;
+	prev = 0;
+
+	lock_acquire(sv->sv_lock);
+	nfileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	for (fileblock=0; fileblock<nfileblocks; fileblock++) {
+		result = sfs_bmap(sv, fileblock, 0, &diskblock);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		if (diskblock == 0) {
+			/* hole */
+			continue;
+		}
+		if (prev == 0 || diskblock != prev + 1) {
+			(*nextents)++;
+		}
+		(*nblocks)++;
+		prev = diskblock;
+	}
+	lock_release(sv->sv_lock);
+
+	return 0;
+}
@@ -39,15 +39,7 @@
 #include "opt-A3.h"
 
 struct vnode;
-
-
-#if OPT_A3
-struct PTE {
-  vaddr_t vaddr;
-  paddr_t paddr;
-  int frame_number;
- };
-#endif
+struct lock;
 
 
 /* 
@@ -59,33 +51,62 @@ struct PTE {
 
 
 #if OPT_A3
+/*
+ * A region of a user address space: the pages in
+ * [r_vbase, r_vbase + r_npages*PAGE_SIZE). Pages are filled on first
+ * touch; the part [r_file_vaddr, r_file_vaddr + r_file_size) comes
+ * from the executable at r_file_offset and the rest is zero-filled.
+ */
+struct region {
+  vaddr_t r_vbase;
+  size_t r_npages;
+  /* permissions: 1 if allowed, 0 otherwise */
+  int r_readable;
+  int r_writeable;
+  int r_executable;
+  /* file-backed part of the region, if any */
+  vaddr_t r_file_vaddr;
+  off_t r_file_offset;
+  size_t r_file_size;
+  /* next region up in the address space */
+  struct region *r_next;
+};
+
 struct addrspace {
-  vaddr_t as_vbase1;
-  struct PTE *as_pt1;
-  size_t as_npages1;
-  /* readable = 1 if readable. 0 otherwise */
-  int as_pt1_readable;
-  /* writable = 1 if writable. 0 otherwise */
-  int as_pt1_writable;
-  /* executable = 1 if executable. 0 otherwise */
-  int as_pt1_executable;
+  /* regions, sorted by address and never overlapping */
+  struct region *as_regions;
+  /* the heap region, starting just above the program's data */
+  struct region *as_heap;
+  /* the break: first byte past the heap; the region is rounded up to pages */
+  vaddr_t as_heap_end;
+  /* the stack region, which vm_fault grows downward */
+  struct region *as_stack;
+
+  /*
+   * Two-level page table indexed by virtual page number. Each entry
+   * of a second-level table is the frame holding the page, 0 if the
+   * page hasn't been touched yet, or a swap slot if PTE_SWAPPED is
+   * set. Second-level tables are allocated as they are needed.
+   */
+  paddr_t **as_pt;
 
-  vaddr_t as_vbase2;
-  struct PTE *as_pt2;
-  size_t as_npages2;
-  /* readable = 1 if readable. 0 otherwise */
-  int as_pt2_readable;
-  /* writable = 1 if writable. 0 otherwise */
-  int as_pt2_writable;
-  /* executable = 1 if executable. 0 otherwise */
-  int as_pt2_executable;
-
-  struct PTE as_stack_pt;
   bool complete_load_elf;
+  /* the executable the regions' file-backed parts are read from */
+  struct vnode *as_vnode;
+
+  /*
+   * Held while the page tables are read or changed: by vm_fault,
+   * by fork while sharing pages, and by the pager while it writes
+   * one of our pages out to swap.
+   */
+  struct lock *as_lock;
+
+  /* TLB tag, valid while as_asid_gen is the current ASID generation */
+  unsigned as_asid;
+  unsigned as_asid_gen;
 };
 #else 
 struct addrspace {
-  struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -93,12 +114,8 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
-
-  #if OPT_A3
-  bool complete_load_elf;
-  #endif
 };
-  
+#endif
 
 /*
  * Functions in addrspace.c:
@@ -134,6 +151,13 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_backing - record that part of a region is initialized
+ *                from a file, so its pages can be read in on demand.
+ *
+ *    as_sbrk   - move the end of the heap by the given (possibly
+ *                negative) number of bytes and hand back the old end.
+ *                Memory given back is released at once.
  */
 
 struct addrspace *as_create(void);
@@ -150,6 +174,13 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+#endif
 
 
 /*
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Blocks of block devices are cached in memory, keyed by device and
+ * block number, and evicted least recently used first. A buffer is
+ * "busy" from buffer_read or buffer_get until buffer_release, and
+ * only the thread holding it may touch its data meanwhile. Changes are
+ * written back when a dirty buffer is evicted or by buffer_sync, not
+ * when it is released.
+ *
+ * Every buffer holds one BUFFER_SIZE-byte block.
+ */
+
+#define BUFFER_SIZE 512
+
+struct device;
+struct buf;
+
+/* Set up the cache. Call once, after vm_bootstrap. */
+void buffer_bootstrap(void);
+
+/* Get block of dev, reading it in if it isn't cached. */
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+
+/*
+ * Get block of dev without reading it in, for a caller that is about
+ * to overwrite all of it and call buffer_mark_dirty. If the block
+ * wasn't cached the buffer comes back zero-filled.
+ */
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+
+/*
+ * Start reading block of dev into the cache, if it isn't there, and
+ * return without waiting. Nothing happens if the device can't queue
+ * requests or no buffer is free. Returns true if a read was started.
+ */
+bool buffer_readahead(struct device *dev, daddr_t block);
+
+/* The data of a busy buffer. */
+void *buffer_map(struct buf *b);
+
+/* Note that the data of a busy buffer was changed. */
+void buffer_mark_dirty(struct buf *b);
+
+/* Let go of a busy buffer. */
+void buffer_release(struct buf *b);
+
+/* Forget block of dev, if cached, without writing it back. */
+void buffer_drop(struct device *dev, daddr_t block);
+
+/* Write back every dirty buffer of dev, or of every device if NULL. */
+int buffer_sync(struct device *dev);
+
+/* Discard every buffer of dev; call after buffer_sync at unmount. */
+void buffer_purge(struct device *dev);
+
+/* Print hit, write-back and read-ahead counts. */
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
@@ -38,8 +38,9 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU every LT_GRANULARITY usec to
+ * count timer ticks; hardclock() then runs each CPU's due timers
+ * (see timer.h).
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -70,8 +71,6 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
@@ -83,5 +82,11 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clocknanosleep() suspends execution for the requested time, rounded
+ * up to whole timer ticks, like userlevel nanosleep(2).
+ */
+void clocknanosleep(time_t secs, uint32_t nsecs);
+
 
 #endif /* _CLOCK_H_ */
@@ -33,7 +33,24 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <timer.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
+
+/*
+ * Number of scheduler priority levels; 0 is the highest. See the
+ * scheduler notes in thread.c.
+ */
+#define SCHED_NLEVELS		4
+
+#if OPT_A3
+/*
+ * Size of the per-cpu cache of free page frames, and how many frames
+ * move between it and the coremap at a time.
+ */
+#define CPU_PCACHE_SIZE		32
+#define CPU_PCACHE_BATCH	16
+#endif
 
 
 /*
@@ -66,9 +83,40 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueues[SCHED_NLEVELS]; /* Run queues, by level */
+	unsigned c_runcount;		/* Threads on all of them */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Scheduler statistics.
+	 * Protected by the runqueue lock.
+	 */
+	uint64_t c_sched_qlensum[SCHED_NLEVELS]; /* Sampled queue lengths */
+	unsigned c_sched_samples;
+	unsigned c_sched_wakeups[SCHED_NLEVELS]; /* Woken threads run, */
+	uint64_t c_sched_latsum[SCHED_NLEVELS];  /* how long they waited */
+	uint32_t c_sched_latmax[SCHED_NLEVELS];  /* (nanoseconds) */
+	unsigned c_idleclocks;		/* Hardclocks spent idle */
+	unsigned c_steals;		/* Threads taken from other cpus */
+
+	/*
+	 * Moving average of the number of runnable threads. Written
+	 * under the runqueue lock; other cpus read it without the
+	 * lock, as a hint.
+	 */
+	unsigned c_loadavg;
+	unsigned c_switches;		/* Context switches (runqueue lock) */
+
+	/*
+	 * Timing wheel; see timer.c.
+	 * Protected by the timer lock.
+	 */
+	struct timer *c_timerwheel[TIMER_WHEELSIZE];
+	uint32_t c_timer_lastrun;	/* Last tick run (only this cpu) */
+	unsigned c_timer_pending;	/* Timers on the wheel */
+	unsigned c_timer_fired;		/* Timers that have gone off */
+	struct spinlock c_timer_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -87,6 +135,38 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+#if OPT_A3
+	/*
+	 * Cache of free page frames, so single-page allocations
+	 * don't need the global coremap lock. Frames in the cache
+	 * are marked in use in the coremap.
+	 * Protected by the page cache lock; only other cpus reclaiming
+	 * memory touch it, so it is almost never contended.
+	 */
+	paddr_t c_pcache[CPU_PCACHE_SIZE];
+	unsigned c_pcache_count;	/* frames currently cached */
+	unsigned c_pcache_hits;		/* allocations served from cache */
+	unsigned c_pcache_misses;	/* allocations that had to refill */
+	unsigned c_pcache_refills;	/* batches taken from the coremap */
+	unsigned c_pcache_drains;	/* batches given back */
+	struct spinlock c_pcache_lock;
+
+	/*
+	 * Address space whose ASID is loaded on this cpu. The pager
+	 * won't evict its pages while it is loaded elsewhere.
+	 * Set under the VM system's ASID lock.
+	 */
+	struct addrspace *c_tlbas;
+
+	/*
+	 * The ASID generation this cpu's TLB contents belong to, and
+	 * machine-dependent TLB bookkeeping (see <machine/vm.h>).
+	 * Only touched at splhigh.
+	 */
+	unsigned c_asid_gen;
+	struct cpu_tlb c_tlb;
+#endif
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -109,6 +189,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the table of all cpus, by software number.
+ */
+unsigned cpu_numcpus(void);
+struct cpu *cpu_getcpu(unsigned number);
+
 /*
  * Return a string describing the CPU type.
  */
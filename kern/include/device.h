@@ -37,15 +37,43 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block I/O request, for devices that have d_submit.
+ *
+ * The caller fills in the first group of fields, then leaves the
+ * request and its buffer alone until the device calls dr_done with
+ * the result. dr_done may be called from an interrupt handler, so it
+ * must not sleep; it may submit further requests.
+ */
+struct devreq {
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* how many blocks */
+	bool dr_write;			/* write (else read) */
+	void *dr_data;			/* kernel buffer, dr_nblocks long */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_arg;			/* for dr_done's use */
+
+	/* The rest belongs to the device while the request is queued. */
+	struct devreq *dr_next;		/* next in the device's queue */
+	struct devreq *dr_merged;	/* contiguous requests run after */
+	uint32_t dr_xfered;		/* blocks done so far */
+	time_t dr_qsecs;		/* when queued */
+	uint32_t dr_qnsecs;
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_submit, if not NULL, starts a devreq and returns without waiting.
+ * d_printstats, if not NULL, prints the device's statistics.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct devreq *);
+	void (*d_printstats)(struct device *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -59,6 +59,9 @@
  * filesystem should have been discarded/released.
  *
  * fs_data is a pointer to filesystem-specific data.
+ *
+ * fs_namecache says lookups on the filesystem may be remembered in
+ * the name cache; see namecache.h for what that commits it to.
  */
 
 struct fs {
@@ -67,6 +70,7 @@ struct fs {
 	struct vnode *(*fs_getroot)(struct fs *);
 	int           (*fs_unmount)(struct fs *);
 
+	bool fs_namecache;
 	void *fs_data;
 };
 
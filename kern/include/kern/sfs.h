@@ -47,6 +47,14 @@
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * Inodes have a double and a triple indirect block after the single
+ * indirect one. They were carved out of space that used to be unused
+ * and zeroed, so older volumes read as having none of either.
+ */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
 
@@ -83,7 +91,9 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Name cache.
+ *
+ * Remembers the results of VOP_LOOKUP, keyed by directory vnode and
+ * name, including names that were not found. Only filesystems that
+ * set fs_namecache are cached; they must call namecache_remove for
+ * every name they create, remove, or rename, after changing the
+ * directory.
+ */
+
+struct vnode;
+struct fs;
+
+/* Set up the cache. Called from vfs_bootstrap. */
+void namecache_bootstrap(void);
+
+/*
+ * Look up NAME in DIR. If it is cached, return true and hand back
+ * its vnode, with a reference, or NULL if the name is known not to
+ * exist. Otherwise return false and hand back a generation number
+ * to pass to namecache_enter.
+ */
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret, unsigned *gen);
+
+/*
+ * Remember what VOP_LOOKUP found for NAME in DIR (VN, or NULL for
+ * ENOENT), unless a name was removed since namecache_lookup
+ * returned GEN.
+ */
+void namecache_enter(struct vnode *dir, const char *name,
+		     struct vnode *vn, unsigned gen);
+
+/* Forget NAME in DIR. */
+void namecache_remove(struct vnode *dir, const char *name);
+
+/* Forget everything on FS; call before unmounting it. */
+void namecache_purge(struct fs *fs);
+
+/* Print hit and miss counts. */
+void namecache_printstats(void);
+
+#endif /* _NAMECACHE_H_ */
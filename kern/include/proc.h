@@ -48,12 +48,24 @@ struct semaphore;
 #endif // UW
 
 #if OPT_A2
-// struct lock *add_child_lock;
-struct lock *pid_lock;
-struct lock *arr_proc_lock;
-struct array arr_proc;
-// struct lock *wait_lock;
-// struct cv *wait_cv;
+struct proc;
+
+/* Array of processes, for each process's list of children. */
+#ifndef PROCINLINE
+#define PROCINLINE INLINE
+#endif
+
+DECLARRAY(proc);
+DEFARRAY(proc, PROCINLINE);
+
+/* Number of buckets in the pid table. Must be a power of two. */
+#define PROC_HASHSIZE 64
+
+/*
+ * Protects the pid table and pid allocation, and every process's
+ * parent and p_children. Lookups only need it for reading.
+ */
+extern struct rwlock *proc_table_lock;
 #endif
 /*
  * Process structure.
@@ -80,15 +92,14 @@ struct proc {
     
 #if OPT_A2
     pid_t PID;
-    pid_t parent;
-//    struct array children;
-    bool exit_status;
+    pid_t parent;			/* -1 once the parent has exited */
+    struct procarray p_children;	/* children that haven't been orphaned */
+    struct proc *p_hashnext;		/* next in pid table bucket */
+    bool exit_status;			/* exited; only the exit record is left */
     int exit_code;
 //    struct lock *add_child_lock;
     struct lock *wait_lock;
     struct cv *wait_cv;
-    struct lock *exit_lock;
-    struct cv *exit_cv;
 //    struct lock *child_lock;
 #endif
  
@@ -125,8 +136,14 @@ struct addrspace *curproc_getas(void);
 struct addrspace *curproc_setas(struct addrspace *);
 
 #if OPT_A2
-/* assign pid to proc */
-void assign_pid(struct proc *proc);
+/*
+ * Find the process with the given pid. Call with proc_table_lock held,
+ * for reading or writing.
+ */
+struct proc *proc_lookup(pid_t pid);
+
+/* Make child a child of parent. Call with proc_table_lock write-held. */
+int proc_addchild(struct proc *parent, struct proc *child);
 #endif
 
 /* _PROC_H_ */
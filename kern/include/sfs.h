@@ -48,11 +48,43 @@
  */
 #include <kern/sfs.h>
 
+/* Buckets in the table of loaded vnodes */
+#define SFS_VNHASHSIZE 64
+
+/*
+ * For allocation the disk is divided into groups of this many blocks,
+ * in the spirit of FFS cylinder groups. A file's blocks are kept
+ * together, and a file big enough to need an indirect block moves on
+ * to the emptiest group so it doesn't crowd out its neighbours.
+ */
+#define SFS_GROUPBLOCKS 512
+
+/*
+ * Locking: sv_lock protects a vnode's inode and contents (for the
+ * directory, its entries). sfs_vnlock protects the table of loaded
+ * vnodes, including the list of inactive ones and the sv_ fields
+ * that link them; finding a vnode that's in use only needs it for
+ * reading. sfs_freemaplock protects the free block bitmap and the
+ * superblock's dirty flag. They are taken in the order directory
+ * sv_lock, file sv_lock, sfs_vnlock, sfs_freemaplock; the buffer
+ * cache has its own lock below all of these.
+ */
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects sv_i, sv_dirty, data */
+	struct sfs_vnode *sv_hashnext;  /* in sfs_vnhash */
+	bool sv_inactive;               /* unreferenced, on the LRU list */
+	struct sfs_vnode *sv_lruprev;   /* more recently inactivated */
+	struct sfs_vnode *sv_lrunext;   /* less recently inactivated */
+	uint32_t sv_nextgoal;           /* where to try allocating next */
+	uint32_t sv_leafbase;           /* first file block sv_leafblock maps */
+	uint32_t sv_leafblock;          /* last single indirect block used */
+	uint32_t sv_ranext;             /* where a sequential read would start */
+	uint32_t sv_rahead;             /* read ahead up to here */
+	uint32_t sv_rawindow;           /* blocks to read ahead */
 };
 
 struct sfs_fs {
@@ -60,9 +92,18 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	/* vnodes loaded into memory, by inode number */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE];
+	unsigned sfs_nvnodes;           /* how many, inactive included */
+	struct sfs_vnode *sfs_lruhead;  /* inactive vnodes */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_ninactive;
+	struct rwlock *sfs_vnlock;      /* protects all of the above */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	unsigned sfs_ngroups;           /* allocation groups */
+	unsigned *sfs_groupfree;        /* free blocks in each group */
+	struct lock *sfs_freemaplock;   /* protects freemap, groups, dirty flags */
 };
 
 /*
@@ -75,17 +116,24 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for whole-block I/O through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Write a vnode's inode into the buffer cache */
+int sfs_writeinode(struct vnode *v);
+
+/* Write back and free the inactive vnodes, for unmount */
+int sfs_flushinactive(struct sfs_fs *sfs);
+
+/* Print inode cache and read-ahead counts */
+void sfs_printstats(void);
+
+/* Count a file's blocks and the contiguous runs they form */
+int sfs_getfrag(struct vnode *v, unsigned *nblocks, unsigned *nextents);
+
 
 #endif /* _SFS_H_ */
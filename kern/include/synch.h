@@ -69,6 +69,10 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds it held by a thread
+ * running on another cpu spins for a while before going to sleep.
+ * Clearing lk_adaptive makes it always sleep.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -80,6 +84,9 @@ struct lock {
     struct spinlock lk_spin;
     struct thread *owner;
     volatile bool held;
+    bool lk_adaptive;		/* spin while the owner is running */
+    unsigned lk_spins;		/* acquisitions that spun (under lk_spin) */
+    unsigned lk_sleeps;		/* times a waiter slept (under lk_spin) */
 };
 
 struct lock *lock_create(const char *name);
@@ -91,12 +98,16 @@ void lock_acquire(struct lock *);
  *                   same time.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
+ *    lock_tryacquire - Get the lock if nobody holds it and return true;
+ *                   otherwise return false at once instead of sleeping.
+ *                   Safe to call with spinlocks held.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
+bool lock_tryacquire(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
@@ -133,8 +144,12 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but stop waiting after TICKS timer
+ *                   ticks (see clocknap). Returns ETIMEDOUT if it
+ *                   did, 0 otherwise; either way the lock is held
+ *                   again on return.
  *
- * For all three operations, the current thread must hold the lock passed
+ * For all these operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
@@ -143,6 +158,66 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers. The
+ * flip side is that a thread must not take the read lock again while
+ * it already holds it, as a writer arriving in between would
+ * deadlock the two.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+    char *rwlock_name;
+    struct wchan *rw_readwchan;	/* readers wait here */
+    struct wchan *rw_writewchan;	/* writers and the upgrader wait here */
+    struct spinlock rw_spin;	/* protects the rest */
+    unsigned rw_readers;		/* readers holding the lock */
+    unsigned rw_writerswaiting;	/* writers waiting for it */
+    struct thread *rw_writer;	/* writer holding it, if any */
+    struct thread *rw_upgrader;	/* reader waiting to upgrade, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading, sharing it with
+ *                           other readers.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing, alone.
+ *    rwlock_release_write - Give up a write hold.
+ *    rwlock_upgrade       - Turn a read hold into a write hold, waiting
+ *                           for the other readers to leave. Only one
+ *                           reader can be waiting to upgrade at a time;
+ *                           if another is, return false at once, still
+ *                           holding the lock for reading. The caller
+ *                           must then release it and acquire it for
+ *                           writing, and recheck what it read.
+ *    rwlock_downgrade     - Turn a write hold into a read hold without
+ *                           letting any writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *    rwlock_held          - Return true if anyone holds the lock in
+ *                           either mode. (Readers aren't tracked, so
+ *                           this is the most an assertion can check.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+bool rwlock_held(struct rwlock *);
 
 
 #endif /* _SYNCH_H_ */
@@ -27,6 +27,7 @@
  * SUCH DAMAGE.
  */
 #include "opt-A2.h"
+#include "opt-A3.h"
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 struct trapframe; /* from <machine/trapframe.h> */
@@ -47,6 +48,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
  */
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
@@ -56,5 +58,8 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 int sys_fork(struct trapframe *ptf, pid_t *retval);
 int sys_execv(userptr_t progname, userptr_t args);
 #endif // opt_A2
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+#endif // opt_A3
 #endif // UW
 #endif /* _SYSCALL_H_ */
@@ -62,6 +62,9 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int lockbench(int, char **);
+int rwtest(int, char **);
+int sleeptest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
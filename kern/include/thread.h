@@ -101,6 +101,16 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields. Protected by the runqueue lock of t_cpu,
+	 * except while the thread is on no list at all.
+	 */
+	unsigned t_level;		/* Priority level, 0 highest */
+	unsigned t_quantum;		/* Hardclocks left at this level */
+	bool t_woken;			/* Made runnable by a wakeup... */
+	time_t t_wakesecs;		/* ...at this time */
+	uint32_t t_wakensecs;
+
 	/*
 	 * Public fields
 	 */
@@ -163,10 +173,17 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a clock tick, and preempt it if it
+ * has used up its quantum or a higher priority thread is waiting.
+ * Called from the timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Print utilization, load, run queue lengths, and wakeup latencies
+ * for each cpu.
  */
-void thread_consider_migration(void);
+void thread_printschedstats(void);
 
 
 #endif /* _THREAD_H_ */
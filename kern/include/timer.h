@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Kernel timers.
+ *
+ * A timer calls a function once, a given number of timer ticks from
+ * now. The timer ticks every LT_GRANULARITY usec, like clocknap()
+ * (see clock.h). Timers wait on the cpu that started them, and each
+ * cpu runs the ones it has that are due from hardclock().
+ *
+ * The function is called from the clock interrupt with the timer
+ * lock of that cpu held. It must not sleep or touch timers, but it
+ * may take spinlocks; it usually locks a wait channel and wakes
+ * someone.
+ *
+ *    timer_init  - Set up a timer to call FUNC with DATA.
+ *    timer_start - Arrange for the timer to go off in TICKS ticks
+ *                  (at least 1). It must not already be pending.
+ *    timer_stop  - Cancel the timer, if it hasn't gone off yet. Returns
+ *                  true if it was still pending. Either way, the
+ *                  function isn't running when timer_stop returns,
+ *                  so the timer may then be freed. Must not be
+ *                  called holding a lock the function takes.
+ */
+
+/* Slots in each cpu's timing wheel. Must be a power of 2. */
+#define TIMER_WHEELSIZE		64
+
+struct cpu;
+
+struct timer {
+	struct timer *tm_next;		/* wheel slot list */
+	struct timer *tm_prev;
+	struct cpu *tm_cpu;		/* cpu we're pending on, or NULL */
+	uint32_t tm_deadline;		/* tick to go off on */
+	void (*tm_func)(void *);
+	void *tm_data;
+};
+
+void timer_init(struct timer *t, void (*func)(void *), void *data);
+void timer_start(struct timer *t, unsigned ticks);
+bool timer_stop(struct timer *t);
+
+/*
+ * For the clock and cpu code: set up a cpu's wheel, count a tick
+ * (from timerclock), and run this cpu's due timers (from hardclock).
+ */
+void timer_cpuinit(struct cpu *c);
+void timer_tick(void);
+void timer_runwheel(void);
+
+#endif /* _TIMER_H_ */
@@ -57,6 +57,7 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_sync      - force all dirty buffers to disk
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
  *    vfs_getdevname - get mounted device name for the filesystem passed in
+ *    vfs_printdevstats - print the statistics of every device that has any
  */
 
 int vfs_setcurdir(struct vnode *dir);
@@ -65,6 +66,7 @@ int vfs_getcurdir(struct vnode **retdir);
 int vfs_sync(void);
 int vfs_getroot(const char *devname, struct vnode **result);
 const char *vfs_getdevname(struct fs *fs);
+void vfs_printdevstats(void);
 
 /*
  * VFS layer mid-level operations.
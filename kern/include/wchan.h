@@ -71,6 +71,13 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but give up after TICKS timer ticks (see
+ * clocknap in clock.h) if not awakened before then. Returns true if
+ * the time ran out.
+ */
+bool wchan_sleep_timeout(struct wchan *wc, unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
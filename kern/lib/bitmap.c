@@ -47,8 +47,19 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * Searching, though, can look at several words at once without caring
+ * about byte order: a run of words is full exactly when all its bits
+ * are set, however they're arranged. The bit array comes from kmalloc
+ * so it's aligned well enough for this.
+ */
+#define WORDS_PER_CHUNK (sizeof(uint32_t)/sizeof(WORD_TYPE))
+#define CHUNK_ALLBITS   (0xffffffff)
+typedef uint32_t __attribute__((__may_alias__)) chunk_t;
+
 struct bitmap {
         unsigned nbits;
+        unsigned hint;          /* where bitmap_alloc starts looking */
         WORD_TYPE *v;
 };
 
@@ -72,6 +83,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->hint = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -95,31 +107,113 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first clear bit with index in [start, end). Whole chunks
+ * of words are skipped while they're full, then the word holding the
+ * clear bit is searched a bit at a time.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned end,
+                unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned bit, ix, endix, offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        /* Bits before the first word boundary */
+        for (bit = start; bit < end && bit % BITS_PER_WORD != 0; bit++) {
+                if ((b->v[bit / BITS_PER_WORD] &
+                     ((WORD_TYPE)1 << (bit % BITS_PER_WORD))) == 0) {
+                        *index = bit;
+                        return 0;
+                }
+        }
+
+        if (bit >= end) {
+                return ENOSPC;
+        }
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
+        /* Whole words */
+        endix = end / BITS_PER_WORD;
+        ix = bit / BITS_PER_WORD;
+        while (ix < endix) {
+                if (ix % WORDS_PER_CHUNK == 0 &&
+                    ix + WORDS_PER_CHUNK <= endix &&
+                    *(chunk_t *)&b->v[ix] == CHUNK_ALLBITS) {
+                        ix += WORDS_PER_CHUNK;
+                        continue;
+                }
+                if (b->v[ix] != WORD_ALLBITS) {
+                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                                if ((b->v[ix] & ((WORD_TYPE)1 << offset))
+                                    == 0) {
+                                        *index = ix*BITS_PER_WORD + offset;
                                         return 0;
                                 }
                         }
                         KASSERT(0);
                 }
+                ix++;
         }
+
+        /* Bits after the last word boundary */
+        for (bit = endix * BITS_PER_WORD; bit < end; bit++) {
+                if ((b->v[bit / BITS_PER_WORD] &
+                     ((WORD_TYPE)1 << (bit % BITS_PER_WORD))) == 0) {
+                        *index = bit;
+                        return 0;
+                }
+        }
+
         return ENOSPC;
 }
 
+/*
+ * Look for a clear bit from START to the end of the bitmap, and then
+ * from the beginning, and set the first one found.
+ */
+static
+int
+bitmap_alloc_from(struct bitmap *b, unsigned start, unsigned *index)
+{
+        if (start >= b->nbits) {
+                start = 0;
+        }
+        if (bitmap_findzero(b, start, b->nbits, index) != 0 &&
+            bitmap_findzero(b, 0, start, index) != 0) {
+                return ENOSPC;
+        }
+        KASSERT(*index < b->nbits);
+        b->v[*index / BITS_PER_WORD] |=
+                (WORD_TYPE)1 << (*index % BITS_PER_WORD);
+        return 0;
+}
+
+/*
+ * Allocate any clear bit. The search resumes where the last one left
+ * off, so it doesn't have to walk over the same full words each time.
+ */
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_alloc_from(b, b->hint, index);
+        if (result) {
+                return result;
+        }
+        b->hint = *index + 1;
+        return 0;
+}
+
+/*
+ * Allocate the clear bit closest after GOAL, wrapping around.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        return bitmap_alloc_from(b, goal, index);
+}
+
 static
 inline
 void
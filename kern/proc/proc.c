@@ -42,6 +42,8 @@
  * process that will have more than one thread is the kernel process.
  */
 
+#define PROCINLINE
+
 #include <types.h>
 #include <proc.h>
 #include <current.h>
@@ -52,6 +54,8 @@
 #include <kern/fcntl.h>  
 #include <kern/errno.h>
 #include <array.h>
+#include <bitmap.h>
+#include <limits.h>
 #include "opt-A2.h"
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -72,7 +76,112 @@ struct semaphore *no_proc_sem;
 #endif  // UW
 
 #if OPT_A2
- static volatile pid_t gPID=4;
+struct rwlock *proc_table_lock;
+
+/*
+ * The pid table: a hash table of every process, chained through
+ * p_hashnext. pid_map has a bit set for each pid in use; pids are
+ * handed out round-robin from pid_next so a pid that was just freed
+ * isn't reused right away.
+ */
+#define PID_HASH(pid) ((unsigned)(pid) & (PROC_HASHSIZE - 1))
+static struct proc *proc_table[PROC_HASHSIZE];
+static struct bitmap *pid_map;
+static pid_t pid_next;
+
+/* Give proc a free pid and enter it in the pid table. */
+static
+int
+proc_table_add(struct proc *proc)
+{
+	pid_t pid;
+	int n;
+
+	rwlock_acquire_write(proc_table_lock);
+	pid = pid_next;
+	for (n = PID_MIN; n <= PID_MAX; n++) {
+		if (!bitmap_isset(pid_map, pid)) {
+			break;
+		}
+		pid = (pid == PID_MAX) ? PID_MIN : pid + 1;
+	}
+	if (n > PID_MAX) {
+		rwlock_release_write(proc_table_lock);
+		return ENPROC;
+	}
+	bitmap_mark(pid_map, pid);
+	pid_next = (pid == PID_MAX) ? PID_MIN : pid + 1;
+
+	proc->PID = pid;
+	proc->p_hashnext = proc_table[PID_HASH(pid)];
+	proc_table[PID_HASH(pid)] = proc;
+	rwlock_release_write(proc_table_lock);
+	return 0;
+}
+
+/*
+ * Take proc out of the pid table and its parent's children, and free
+ * its pid.
+ */
+static
+void
+proc_table_remove(struct proc *proc)
+{
+	struct proc **pp, *parent;
+	unsigned i, num;
+
+	rwlock_acquire_write(proc_table_lock);
+	for (pp = &proc_table[PID_HASH(proc->PID)]; *pp != proc;
+	     pp = &(*pp)->p_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_hashnext;
+	bitmap_unmark(pid_map, proc->PID);
+
+	if (proc->parent != -1) {
+		parent = proc_lookup(proc->parent);
+		KASSERT(parent != NULL);
+		num = procarray_num(&parent->p_children);
+		for (i=0; i<num; i++) {
+			if (procarray_get(&parent->p_children, i) == proc) {
+				procarray_remove(&parent->p_children, i);
+				break;
+			}
+		}
+	}
+	rwlock_release_write(proc_table_lock);
+}
+
+struct proc *
+proc_lookup(pid_t pid)
+{
+	struct proc *proc;
+
+	KASSERT(rwlock_held(proc_table_lock));
+	for (proc = proc_table[PID_HASH(pid)]; proc != NULL;
+	     proc = proc->p_hashnext) {
+		if (proc->PID == pid) {
+			return proc;
+		}
+	}
+	return NULL;
+}
+
+int
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(proc_table_lock));
+	KASSERT(child->parent == -1);
+
+	result = procarray_add(&parent->p_children, child, NULL);
+	if (result) {
+		return result;
+	}
+	child->parent = parent->PID;
+	return 0;
+}
 #endif
 
 
@@ -110,29 +219,25 @@ proc_create(const char *name)
 #endif // UW
 
 #if OPT_A2
-   //  add_child_lock = lock_create("add_child_lock");
-    // provide mutual exclusion
-    /* 
-if (gPID == 4) {
-  proc->PID = gPID;
-  ++gPID;
-} else {    
-	lock_acquire(pid_lock);
-    // assign pid
-    proc->PID = gPID;
-    ++gPID;
-    lock_release(pid_lock);    
-}
-*/
-
-//	proc->add_child_lock = lock_create("add_child_lock");
     proc->parent = -1;
-	if (gPID) {
-		proc->PID = gPID;
-		++gPID;
-	} else {
-		assign_pid(proc);
-	}
+    procarray_init(&proc->p_children);
+    if (kproc == NULL) {
+	/*
+	 * This is kproc, made before there is a thread to take
+	 * proc_table_lock. It is never looked up or destroyed, so it
+	 * keeps a pid below PID_MIN and stays out of the table.
+	 */
+	proc->PID = PID_MIN - 1;
+	proc->p_hashnext = NULL;
+    }
+    else if (proc_table_add(proc)) {
+	procarray_cleanup(&proc->p_children);
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+	kfree(proc->p_name);
+	kfree(proc);
+	return NULL;
+    }
     proc->exit_status = false;
     proc->exit_code = 0;
     proc->wait_lock = lock_create("wait_lock");
@@ -143,26 +248,6 @@ if (gPID == 4) {
     if (proc->wait_cv==NULL) {
     	panic ("cannot create wait_cv");
     }
-    proc->exit_lock = lock_create("exit_lock");
-    if (proc->exit_lock==NULL) {
-    	panic ("cannot create wait_lock");
-    }
-    proc->exit_cv = cv_create("exit_cv");
-    if (proc->exit_cv==NULL) {
-    	panic ("cannot create wait_cv");
-    }
-    /* 
-    proc->child_lock = lock_create("child_lock");
-    if (proc->child_lock==NULL) {
-    	panic ("cannot create child_lock");
-    }
-    proc->children = *array_create();
-    array_init(&proc->children);
-    */
-
-    array_add(&arr_proc, proc, NULL);
-//    int length = array_num(&proc->children);
-//    kprintf("proc->children.size = %d",length);
 #endif
 	return proc;
 }
@@ -229,16 +314,12 @@ proc_destroy(struct proc *proc)
 
     
 #if OPT_A2
-//	array_destroy(&proc->children);
-//	int length = array_num(&proc->children);
-//	kprintf("proc->children.size = %d",length);
-//    array_cleanup(&proc->children);
-//    lock_destroy(proc->add_child_lock);
-//    spinlock_release(&proc->p_lock);
+    proc_table_remove(proc);
+    /* sys__exit orphans or reaps every child before we get here */
+    KASSERT(procarray_num(&proc->p_children) == 0);
+    procarray_cleanup(&proc->p_children);
     lock_destroy(proc->wait_lock);
     cv_destroy(proc->wait_cv);
-    lock_destroy(proc->exit_lock);
-    cv_destroy(proc->exit_cv);
 //    lock_destroy(proc->child_lock);
     kfree(proc->p_name);
     kfree(proc);
@@ -269,6 +350,18 @@ void
 proc_bootstrap(void)
 {
   //kprintf("enter proc_bootstrap\n");
+  #if OPT_A2
+  proc_table_lock = rwlock_create("proc_table_lock");
+  pid_map = bitmap_create(PID_MAX + 1);
+  if (proc_table_lock == NULL || pid_map == NULL) {
+    panic("could not create the pid table\n");
+  }
+  for (pid_t pid = 0; pid < PID_MIN; pid++) {
+    bitmap_mark(pid_map, pid);
+  }
+  pid_next = PID_MIN;
+  #endif // opt_a2
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -286,15 +379,6 @@ proc_bootstrap(void)
   }
 #endif // UW
   //kprintf("finish proc_bootstrap\n");
-
-  #if OPT_A2
-  pid_lock = lock_create("pid_lock");
-  arr_proc_lock = lock_create("arr_proc_lock");
-  kproc->PID = gPID;
-  ++gPID;
-  arr_proc = *array_create();
-  array_init(&arr_proc);
-  #endif // opt_a2
 }
 
 /*
@@ -451,33 +535,3 @@ curproc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
-
-
-
-#if OPT_A2
-void assign_pid(struct proc *proc) {
-    lock_acquire(pid_lock);
-    proc->PID = gPID;
-    ++gPID;
-    lock_release(pid_lock);
-}
-
-/* 
-struct proc *find_child(struct proc *proc, pid_t pid) {
-	struct proc *c;
-	lock_acquire(p->child_lock);
-	int length = array_num(&proc->children);
-	for(int i=0; i<length; ++i) {
-		c = array_get(&proc->children, i);
-		if (c->PID == pid) {
-			lock_release(p->child_lock);
-			return c;
-		}
-	}
-	lock_release(proc->child_lock);
-	return NULL;
-}
-*/
-
-#endif
-
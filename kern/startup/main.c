@@ -44,6 +44,7 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -112,6 +113,7 @@ boot(void)
 	kprintf("\n");
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	buffer_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -130,8 +132,7 @@ void
 shutdown(void)
 {
 #if OPT_A2
-	lock_destroy(pid_lock);
-	lock_destroy(arr_proc_lock);
+	rwlock_destroy(proc_table_lock);
 #endif
 	kprintf("Shutting down.\n");
 	
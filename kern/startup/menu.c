@@ -39,13 +39,17 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -419,10 +423,97 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+#if OPT_A3
+	coremap_printstats();
+#endif
 	
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+	return 0;
+}
+
+static
+int
+cmd_namestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	namecache_printstats();
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printschedstats();
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_inodestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+	return 0;
+}
+
+static
+int
+cmd_fragstats(int nargs, char **args)
+{
+	struct vnode *v;
+	unsigned nblocks, nextents;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: frag file\n");
+		return EINVAL;
+	}
+
+	result = vfs_lookup(args[1], &v);
+	if (result) {
+		return result;
+	}
+	result = sfs_getfrag(v, &nblocks, &nextents);
+	VOP_DECREF(v);
+	if (result) {
+		return result;
+	}
+
+	kprintf("%s: %u blocks in %u extents\n", args[1], nblocks, nextents);
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -493,6 +584,9 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Lock benchmark        (1)     ",
+	"[sy5] RW lock test          (1)     ",
+	"[sy6] Sleep test                    ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -533,6 +627,14 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[nc] Name cache stats               ",
+	"[dq] Disk queue stats               ",
+	"[sq] Scheduler queue stats          ",
+#if OPT_SFS
+	"[ic] SFS inode cache stats          ",
+	"[frag] SFS file fragmentation       ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -589,6 +691,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",         cmd_bufstats },
+	{ "nc",         cmd_namestats },
+	{ "dq",         cmd_diskstats },
+	{ "sq",         cmd_schedstats },
+#if OPT_SFS
+	{ "ic",         cmd_inodestats },
+	{ "frag",       cmd_fragstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -606,6 +716,9 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	lockbench },
+	{ "sy5",	rwtest },
+	{ "sy6",	sleeptest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
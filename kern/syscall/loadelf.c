@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +75,37 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_A3
+/*
+ * With demand paging nothing is read here: we only tell the address
+ * space where the segment's contents live in the file, and vm_fault
+ * reads each page the first time it is touched. The rest of the
+ * segment is zero-filled on demand.
+ *
+ * as_define_backing checks that the segment lies inside a region
+ * defined earlier, which is what keeps executables from loading
+ * themselves into kernel space.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr, 
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_backing(as, v, offset, vaddr, filesize);
+}
+#else
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -145,6 +177,8 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#endif /* OPT_A3 */
+
 /*
  * Load an ELF executable user program into the current address space.
  *
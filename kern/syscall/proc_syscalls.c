@@ -10,11 +10,13 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <synch.h>
 #include <mips/trapframe.h>
 #include <limits.h>
 #include <vm.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <test.h>
 #include <kern/fcntl.h> 
 
@@ -26,63 +28,74 @@ void sys__exit(int exitcode) {
   #if OPT_A2
   struct addrspace *as;
   struct proc *p = curproc;
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
+  struct proc *c;
+  unsigned n;
+  bool orphan;
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
   KASSERT(curproc->p_addrspace != NULL);
 
-  /* remove p's children */
-  lock_acquire(arr_proc_lock);
-  unsigned length = array_num(&arr_proc);
-  // kprintf("length = %d\n",length);
-  for (unsigned i=0; i<length; ++i) {
-    struct proc *temp = array_get(&arr_proc,i);
-    if (temp->parent == curproc->PID) {
-      temp->parent = -1;
-      lock_acquire(temp->exit_lock);
-      cv_broadcast(temp->exit_cv, temp->exit_lock);
-      lock_release(temp->exit_lock);
-    }
-  }
-  lock_release(arr_proc_lock); 
-
-  /* set p's exit code */
-  p->exit_code = _MKWAIT_EXIT(exitcode);
-//  kprintf("p->exit_code = %d\n", p->exit_code);  
-  /* set p's exit status t'';,o true */
-  p->exit_status = true;
-
-  /* wake up the parent wating for p's exit code */
-  lock_acquire(p->wait_lock);
-  cv_broadcast(p->wait_cv, p->wait_lock);
-  lock_release(p->wait_lock);
-
-  lock_acquire(p->exit_lock);
-  while (p->parent != -1) {
-    cv_wait(p->exit_cv, p->exit_lock);
-  }
-  lock_release(p->exit_lock);
-
-  as_deactivate();
   /*
-   * clear p_addrspace before calling as_destroy. Otherwise if
-   * as_destroy sleeps (which is quite possible) when we
-   * come back we'll be calling as_activate on a
-   * half-destroyed address space. This tends to be
-   * messily fatal.
+   * Free everything but the exit record now; waitpid only needs
+   * exit_code. Clear p_addrspace before calling as_destroy.
+   * Otherwise if as_destroy sleeps (which is quite possible) when we
+   * come back we'll be calling as_activate on a half-destroyed
+   * address space. This tends to be messily fatal.
    */
+  as_deactivate();
   as = curproc_setas(NULL);
   as_destroy(as);
+#ifdef UW
+  if (p->console) {
+    vfs_close(p->console);
+    p->console = NULL;
+  }
+#endif
+  if (p->p_cwd) {
+    VOP_DECREF(p->p_cwd);
+    p->p_cwd = NULL;
+  }
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
+  /*
+   * Orphan p's children. Those that have already exited have no one
+   * left to wait for them, so reap them here.
+   */
+  rwlock_acquire_write(proc_table_lock);
+  while ((n = procarray_num(&p->p_children)) > 0) {
+    c = procarray_get(&p->p_children, n-1);
+    procarray_remove(&p->p_children, n-1);
+    c->parent = -1;
+    if (c->exit_status) {
+      rwlock_release_write(proc_table_lock);
+      proc_destroy(c);
+      rwlock_acquire_write(proc_table_lock);
+    }
+  }
+
+  /*
+   * p is now a zombie. If there is a parent, it reaps p in waitpid or
+   * when it exits itself, and may do so as soon as we unlock; don't
+   * touch p after that.
+   */
+  lock_acquire(p->wait_lock);
+  p->exit_code = _MKWAIT_EXIT(exitcode);
+  p->exit_status = true;
+  orphan = (p->parent == -1);
+  cv_broadcast(p->wait_cv, p->wait_lock);
+  lock_release(p->wait_lock);
+  rwlock_release_write(proc_table_lock);
+
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
-  proc_destroy(p);
-  
+  if (orphan) {
+    proc_destroy(p);
+  }
+
+  /* thread_exit frees our kernel stack once we are off it */
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
   panic("return from thread_exit in sys_exit\n");
@@ -129,22 +142,18 @@ sys_waitpid(pid_t pid,
   }
 
   #if OPT_A2
-  /* check if curproc has a child with given pid */
-  struct proc *c = NULL;
-  lock_acquire(arr_proc_lock);
-  int length = array_num(&arr_proc);
-//  kprintf("curproc->children.size = %d",length);
-  for (int i=0; i<length; ++i) {
-    struct proc *temp = array_get(&arr_proc,i);
-    if (pid == temp->PID) {
-      c = temp;
-      break;
-    }
-  }
-  lock_release(arr_proc_lock);
-  if (c == NULL) {
+  /*
+   * check if curproc has a child with given pid; a child can't go
+   * away before we exit, so c stays valid after we unlock
+   */
+  struct proc *c;
+  rwlock_acquire_read(proc_table_lock);
+  c = proc_lookup(pid);
+  if (c == NULL || c->parent != curproc->PID) {
+    rwlock_release_read(proc_table_lock);
     return ECHILD;
   }
+  rwlock_release_read(proc_table_lock);
 // kprintf("input pid = %d", pid);
 
   /* if c is not exited, curproc wait until it exits */
@@ -156,6 +165,9 @@ sys_waitpid(pid_t pid,
   lock_release(c->wait_lock); 
   exitstatus = c->exit_code;
 
+  /* c is a zombie with nothing left but its exit record; reap it */
+  proc_destroy(c);
+
 //kprintf("exitstatus=%d\n",exitstatus);
 #else
   /* for now, just pretend the exitstatus is 0 */
@@ -195,14 +207,11 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
 //  panic("cannot copy parent's addr space\n");
     return ENOMEM;
   }
-    /* provide mutual exclusion */
-    // lock_acquire(lock);
     /* add parent-child relationship */
   int temp;
-  lock_acquire(arr_proc_lock);
-  temp = array_add(&arr_proc, c, NULL);
-  c->parent = curproc->PID;
-  lock_release(arr_proc_lock);
+  rwlock_acquire_write(proc_table_lock);
+  temp = proc_addchild(curproc, c);
+  rwlock_release_write(proc_table_lock);
 
     /* check if add_child failed */
   if (temp) {
@@ -371,3 +380,16 @@ int sys_execv(userptr_t program, userptr_t args) {
 }
 #endif 
 
+#if OPT_A3
+/* move the end of the heap by amount bytes and return the old end */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+
+  if (as == NULL) {
+    return ENOMEM;
+  }
+  return as_sbrk(as, amount, retval);
+}
+#endif
@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,36 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time in the timespec REQ. Nothing can cut the sleep
+ * short, so the time left, stored in REM if it isn't NULL, is always
+ * zero.
+ */
+int
+sys_nanosleep(const_userptr_t req, userptr_t rem)
+{
+	struct timespec ts;
+	int result;
+
+	result = copyin(req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	clocknanosleep(ts.tv_sec, ts.tv_nsec);
+
+	if (rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
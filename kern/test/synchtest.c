@@ -34,6 +34,7 @@
 #include <types.h>
 #include <lib.h>
 #include <clock.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -347,3 +348,345 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Writers store a consistent triple in
+ * testval1-3, yielding halfway through; readers check that they never
+ * see a half-written one and never overlap a writer, and yield while
+ * holding the lock so that they overlap each other. Every fourth
+ * thread writes, and now and then a reader upgrades to write and
+ * downgrades back.
+ */
+
+#define NRWLOOPS      60
+
+static struct rwlock *testrwlock;
+static struct semaphore *rwdonesem;
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters, rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+/* Note entering a read or write section, and check who else is in. */
+static
+void
+rwenter(unsigned long num, bool writing)
+{
+	bool bad;
+
+	spinlock_acquire(&rwcountlock);
+	if (writing) {
+		rwwriters++;
+		bad = rwwriters != 1 || rwreaders != 0;
+	}
+	else {
+		rwreaders++;
+		bad = rwwriters != 0;
+		if (rwreaders > rwmaxreaders) {
+			rwmaxreaders = rwreaders;
+		}
+	}
+	spinlock_release(&rwcountlock);
+
+	if (bad) {
+		rwfail(num, writing ? "Writer not alone" :
+		       "Reader overlaps writer");
+	}
+}
+
+static
+void
+rwleave(bool writing)
+{
+	spinlock_acquire(&rwcountlock);
+	if (writing) {
+		rwwriters--;
+	}
+	else {
+		rwreaders--;
+	}
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwwrite(unsigned long num)
+{
+	testval1 = num;
+	thread_yield();
+	testval2 = num*num;
+	testval3 = num%3;
+}
+
+static
+void
+rwcheck(unsigned long num)
+{
+	unsigned long v1 = testval1, v2 = testval2, v3 = testval3;
+
+	if (v2 != v1*v1 || v3 != v1%3) {
+		rwfail(num, "Mismatch on testval1/testval2/testval3");
+	}
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			rwenter(num, true);
+			rwwrite(num);
+			rwcheck(num);
+			rwleave(true);
+			rwlock_release_write(testrwlock);
+			continue;
+		}
+
+		rwlock_acquire_read(testrwlock);
+		rwenter(num, false);
+		rwcheck(num);
+		thread_yield();
+		rwcheck(num);
+
+		if (num % 4 == 1 && i % 8 == 0) {
+			rwleave(false);
+			if (!rwlock_upgrade(testrwlock)) {
+				rwlock_release_read(testrwlock);
+				rwlock_acquire_write(testrwlock);
+			}
+			rwenter(num, true);
+			rwwrite(num);
+			rwcheck(num);
+			rwleave(true);
+			rwlock_downgrade(testrwlock);
+			rwenter(num, false);
+			rwcheck(num);
+		}
+
+		rwleave(false);
+		rwlock_release_read(testrwlock);
+	}
+	V(rwdonesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	testrwlock = rwlock_create("testrwlock");
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (testrwlock == NULL || rwdonesem == NULL) {
+		panic("rwtest: out of memory\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwreaders = rwwriters = rwmaxreaders = 0;
+	rwfailed = false;
+
+	kprintf("Starting reader-writer lock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	rwlock_destroy(testrwlock);
+	sem_destroy(rwdonesem);
+	testrwlock = NULL;
+	rwdonesem = NULL;
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Reader-writer lock test done: up to %u readers at once.\n",
+		rwmaxreaders);
+
+	return 0;
+}
+
+/*
+ * Lock benchmark: NBENCHTHREADS threads take turns at one lock with a
+ * short critical section, the case adaptive locks are meant for. It
+ * runs once with the lock made to always sleep and once adaptive,
+ * so the two can be compared; it only shows a difference with more
+ * than one cpu.
+ */
+
+#define NBENCHTHREADS 8
+#define NBENCHLOOPS   2000
+#define BENCHHOLD     20	/* work done holding the lock */
+#define BENCHTHINK    200	/* work done between acquisitions */
+
+static struct lock *benchlock;
+static struct semaphore *benchdone;
+static volatile unsigned long benchcount;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(benchlock);
+		for (j=0; j<BENCHHOLD; j++) {
+			/* nothing */
+		}
+		benchcount++;
+		lock_release(benchlock);
+		for (j=0; j<BENCHTHINK; j++) {
+			/* nothing */
+		}
+	}
+	V(benchdone);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+void
+lockbenchrun(bool adaptive)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	int i, result;
+
+	benchlock = lock_create("lockbench");
+	if (benchlock == NULL) {
+		panic("lockbench: lock_create failed\n");
+	}
+	benchlock->lk_adaptive = adaptive;
+	benchcount = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(benchdone);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+
+	if (benchcount != NBENCHTHREADS * NBENCHLOOPS) {
+		kprintf("Count is %lu, expected %u\n", benchcount,
+			NBENCHTHREADS * NBENCHLOOPS);
+		kprintf("Test failed\n");
+	}
+	kprintf("%s locks: %lu.%03lu seconds, %u acquisitions spun, "
+		"%u sleeps\n", adaptive ? "Adaptive" : "Sleeping",
+		(unsigned long)secs2, (unsigned long)(nsecs2 / 1000000),
+		benchlock->lk_spins, benchlock->lk_sleeps);
+
+	lock_destroy(benchlock);
+	benchlock = NULL;
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	benchdone = sem_create("lockbench", 0);
+	if (benchdone == NULL) {
+		panic("lockbench: sem_create failed\n");
+	}
+
+	kprintf("Starting lock benchmark...\n");
+	lockbenchrun(false);
+	lockbenchrun(true);
+
+	sem_destroy(benchdone);
+	benchdone = NULL;
+	kprintf("Lock benchmark done.\n");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sleep test: clocknanosleep must never return early.
+
+static const struct {
+	time_t secs;
+	uint32_t nsecs;
+} sleeptimes[] = {
+	{ 0, 1 },
+	{ 0, 1000000 },
+	{ 0, 9999999 },
+	{ 0, 10000000 },
+	{ 0, 15000000 },
+	{ 0, 50000000 },
+	{ 1, 0 },
+};
+
+#define NSLEEPTIMES (sizeof(sleeptimes) / sizeof(sleeptimes[0]))
+
+int
+sleeptest(int nargs, char **args)
+{
+	time_t secs1, secs2, esecs;
+	uint32_t nsecs1, nsecs2, ensecs;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting sleep test...\n");
+	for (i=0; i<NSLEEPTIMES; i++) {
+		gettime(&secs1, &nsecs1);
+		clocknanosleep(sleeptimes[i].secs, sleeptimes[i].nsecs);
+		gettime(&secs2, &nsecs2);
+		getinterval(secs1, nsecs1, secs2, nsecs2, &esecs, &ensecs);
+
+		kprintf("asked for %lu.%09lu s, slept %lu.%09lu s\n",
+			(unsigned long)sleeptimes[i].secs,
+			(unsigned long)sleeptimes[i].nsecs,
+			(unsigned long)esecs, (unsigned long)ensecs);
+		if (esecs < sleeptimes[i].secs ||
+		    (esecs == sleeptimes[i].secs &&
+		     ensecs < sleeptimes[i].nsecs)) {
+			kprintf("Woke up early\n");
+			kprintf("Test failed\n");
+			return 0;
+		}
+	}
+	kprintf("Sleep test done.\n");
+
+	return 0;
+}
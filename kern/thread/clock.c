@@ -33,6 +33,7 @@
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
+#include <timer.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
 
@@ -52,26 +53,21 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep and clocknap wait on these, each for its own
+ * timer; nothing else wakes them. A timer has to find its thread on
+ * the channel, so sleepers are spread over several channels to keep
+ * the lists short.
  */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
- */
-static struct wchan *minibolt;
+#define NAPCHANS	16
+#define NAPCHAN(t)	(napchans[((uintptr_t)(t) >> 6) % NAPCHANS])
+static struct wchan *napchans[NAPCHANS];
 
 /* 
- * number of minibolts per second
- */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
-
-/*
- * minibolt countdown
+ * number of timer ticks per second
  */
-static int minicount;
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
 
 /*
  * Setup.
@@ -79,17 +75,16 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	unsigned i;
+
+	for (i=0; i<NAPCHANS; i++) {
+		napchans[i] = wchan_create("clocknap");
+		if (napchans[i] == NULL) {
+			panic("Couldn't create napchan\n");
+		}
 	}
-	minicount = MINI_PER_SECOND;
 	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	KASSERT(MINI_PER_SECOND > 0);
 }
 
 /*
@@ -99,13 +94,8 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
-	}
+	/* Advance the timer tick count; each cpu runs its own timers. */
+	timer_tick();
 }
 
 /*
@@ -123,10 +113,8 @@ hardclock(void)
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
-	thread_yield();
+	timer_runwheel();
+	thread_tick();
 }
 
 /*
@@ -135,11 +123,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clocknap(num_secs * MINI_PER_SECOND);
+	}
 }
 
 /*
@@ -149,9 +135,39 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	struct wchan *wc;
+
+	if (num_ticks > 0) {
+		wc = NAPCHAN(curthread);
+		wchan_lock(wc);
+		wchan_sleep_timeout(wc, num_ticks);
+	}
+}
+
+/*
+ * Suspend execution for secs seconds and nsecs nanoseconds, rounded
+ * up to whole timer ticks. The current tick is already partly over,
+ * so it doesn't count. Long sleeps are taken in pieces so the tick
+ * count doesn't overflow.
+ */
+void
+clocknanosleep(time_t secs, uint32_t nsecs)
+{
+	const uint32_t nsecs_per_tick = LT_GRANULARITY * 1000;
+	const time_t maxsecs = 0x7fffffff / MINI_PER_SECOND - 1;
+	time_t ticks;
+
+	KASSERT(secs >= 0);
+	KASSERT(nsecs < 1000000000);
+
+	while (secs > maxsecs) {
+		clocknap((int)(maxsecs * MINI_PER_SECOND));
+		secs -= maxsecs;
+	}
+	if (secs == 0 && nsecs == 0) {
+		return;
+	}
+	ticks = secs * MINI_PER_SECOND
+		+ (nsecs + nsecs_per_tick - 1) / nsecs_per_tick + 1;
+	clocknap((int)ticks);
 }
@@ -33,9 +33,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -174,6 +176,9 @@ lock_create(const char *name)
     spinlock_init(&lock->lk_spin);
     lock->owner = NULL;
     lock->held = 0;
+    lock->lk_adaptive = true;
+    lock->lk_spins = 0;
+    lock->lk_sleeps = 0;
     return lock;
 }
 
@@ -192,26 +197,91 @@ lock_destroy(struct lock *lock)
     
 }
 
+/*
+ * A lock held by a thread that is running on another cpu will most
+ * likely be released in a moment, and waiting for that is cheaper
+ * than two context switches. So lock_acquire spins while that's the
+ * case, looking at the lock LOCK_SPINCHECK times between checks on
+ * the owner, for at most LOCK_SPINMAX such rounds before it gives up
+ * and sleeps anyway. If the owner is asleep or is waiting for our own
+ * cpu, spinning can't help.
+ */
+#define LOCK_SPINCHECK  100
+#define LOCK_SPINMAX    50
+
+/*
+ * Return true if the lock's owner is running on another cpu. Must be
+ * called with lk_spin held: that keeps the owner from releasing the
+ * lock, and thus from exiting, while we look at it.
+ */
+static
+bool
+lock_ownerrunning(struct lock *lock)
+{
+    struct thread *owner;
+
+    KASSERT(spinlock_do_i_hold(&lock->lk_spin));
+
+    owner = lock->owner;
+    return owner != NULL && owner->t_state == S_RUN &&
+        owner->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+    unsigned rounds, i;
+
     // Write this
     KASSERT(lock != NULL);
     KASSERT(!lock_do_i_hold(lock));
     
     spinlock_acquire(&lock->lk_spin);
+    rounds = 0;
     while (lock->held) {
+        if (lock->lk_adaptive && rounds < LOCK_SPINMAX &&
+            lock_ownerrunning(lock)) {
+            spinlock_release(&lock->lk_spin);
+            for (i=0; i<LOCK_SPINCHECK && lock->held; i++) {
+                /* spin */
+            }
+            spinlock_acquire(&lock->lk_spin);
+            rounds++;
+            continue;
+        }
+        lock->lk_sleeps++;
         wchan_lock(lock->lk_wchan);
         spinlock_release(&lock->lk_spin);
         wchan_sleep(lock->lk_wchan);
         spinlock_acquire(&lock->lk_spin);
     }
+    if (rounds > 0) {
+        lock->lk_spins++;
+    }
     lock->held = 1;
     lock->owner = curthread;
     spinlock_release(&lock->lk_spin);
     //   (void)lock;  // suppress warning until code gets written
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+    bool got;
+
+    KASSERT(lock != NULL);
+    KASSERT(!lock_do_i_hold(lock));
+
+    spinlock_acquire(&lock->lk_spin);
+    got = !lock->held;
+    if (got) {
+        lock->held = 1;
+        lock->owner = curthread;
+    }
+    spinlock_release(&lock->lk_spin);
+    return got;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -306,6 +376,24 @@ cv_wait(struct cv *cv, struct lock *lock)
     //(void)lock;  // suppress warning until code gets written
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+    bool expired;
+
+    KASSERT(cv != NULL);
+    KASSERT(lock != NULL);
+
+    spinlock_acquire(&cv->cv_spin);
+    wchan_lock(cv->cv_wchan);
+    lock_release(lock);
+    spinlock_release(&cv->cv_spin);
+    expired = wchan_sleep_timeout(cv->cv_wchan, ticks);
+    lock_acquire(lock);
+
+    return expired ? ETIMEDOUT : 0;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -334,3 +422,208 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     (void)lock;  // suppress warning until code gets written
 }
 
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+    struct rwlock *rw;
+
+    rw = kmalloc(sizeof(struct rwlock));
+    if (rw == NULL) {
+        return NULL;
+    }
+
+    rw->rwlock_name = kstrdup(name);
+    if (rw->rwlock_name == NULL) {
+        kfree(rw);
+        return NULL;
+    }
+
+    rw->rw_readwchan = wchan_create(rw->rwlock_name);
+    if (rw->rw_readwchan == NULL) {
+        kfree(rw->rwlock_name);
+        kfree(rw);
+        return NULL;
+    }
+    rw->rw_writewchan = wchan_create(rw->rwlock_name);
+    if (rw->rw_writewchan == NULL) {
+        wchan_destroy(rw->rw_readwchan);
+        kfree(rw->rwlock_name);
+        kfree(rw);
+        return NULL;
+    }
+
+    spinlock_init(&rw->rw_spin);
+    rw->rw_readers = 0;
+    rw->rw_writerswaiting = 0;
+    rw->rw_writer = NULL;
+    rw->rw_upgrader = NULL;
+    return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+    KASSERT(rw->rw_readers == 0);
+    KASSERT(rw->rw_writer == NULL);
+    KASSERT(rw->rw_writerswaiting == 0);
+
+    spinlock_cleanup(&rw->rw_spin);
+    wchan_destroy(rw->rw_writewchan);
+    wchan_destroy(rw->rw_readwchan);
+
+    kfree(rw->rwlock_name);
+    kfree(rw);
+}
+
+/*
+ * Sleep on WC, which must be one of RW's. Called with rw_spin held;
+ * returns with it held again.
+ */
+static
+void
+rwlock_sleep(struct rwlock *rw, struct wchan *wc)
+{
+    wchan_lock(wc);
+    spinlock_release(&rw->rw_spin);
+    wchan_sleep(wc);
+    spinlock_acquire(&rw->rw_spin);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+    KASSERT(rw->rw_writer != curthread);
+
+    spinlock_acquire(&rw->rw_spin);
+    /* Wait behind writers, waiting or not, and any upgrade */
+    while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0 ||
+           rw->rw_upgrader != NULL) {
+        rwlock_sleep(rw, rw->rw_readwchan);
+    }
+    rw->rw_readers++;
+    spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spin);
+    KASSERT(rw->rw_readers > 0);
+    KASSERT(rw->rw_writer == NULL);
+    rw->rw_readers--;
+    if (rw->rw_readers == 1 && rw->rw_upgrader != NULL) {
+        /* The one left is the upgrader; it shares the writers' channel */
+        wchan_wakeall(rw->rw_writewchan);
+    }
+    else if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+        wchan_wakeone(rw->rw_writewchan);
+    }
+    spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+    KASSERT(rw->rw_writer != curthread);
+
+    spinlock_acquire(&rw->rw_spin);
+    rw->rw_writerswaiting++;
+    while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+        rwlock_sleep(rw, rw->rw_writewchan);
+    }
+    rw->rw_writerswaiting--;
+    rw->rw_writer = curthread;
+    spinlock_release(&rw->rw_spin);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spin);
+    KASSERT(rw->rw_writer == curthread);
+    KASSERT(rw->rw_readers == 0);
+    rw->rw_writer = NULL;
+    if (rw->rw_writerswaiting > 0) {
+        wchan_wakeone(rw->rw_writewchan);
+    }
+    else {
+        wchan_wakeall(rw->rw_readwchan);
+    }
+    spinlock_release(&rw->rw_spin);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spin);
+    KASSERT(rw->rw_readers > 0);
+    KASSERT(rw->rw_writer == NULL);
+    if (rw->rw_upgrader != NULL) {
+        /* Two upgraders would wait for each other forever */
+        spinlock_release(&rw->rw_spin);
+        return false;
+    }
+
+    /*
+     * New readers wait while we do, and writers can't get in while
+     * we still hold a read, so when the other readers are gone the
+     * lock passes straight to us.
+     */
+    rw->rw_upgrader = curthread;
+    while (rw->rw_readers > 1) {
+        rwlock_sleep(rw, rw->rw_writewchan);
+    }
+    rw->rw_upgrader = NULL;
+    rw->rw_readers = 0;
+    rw->rw_writer = curthread;
+    spinlock_release(&rw->rw_spin);
+    return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rw_spin);
+    KASSERT(rw->rw_writer == curthread);
+    rw->rw_writer = NULL;
+    rw->rw_readers = 1;
+    if (rw->rw_writerswaiting == 0) {
+        /* Let waiting readers share with us */
+        wchan_wakeall(rw->rw_readwchan);
+    }
+    spinlock_release(&rw->rw_spin);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    return rw->rw_writer == curthread;
+}
+
+bool
+rwlock_held(struct rwlock *rw)
+{
+    KASSERT(rw != NULL);
+
+    return rw->rw_writer != NULL || rw->rw_readers > 0;
+}
@@ -44,14 +44,17 @@
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
+#include <timer.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +75,22 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduler tuning. A thread at level L gets SCHED_QUANTUM(L)
+ * hardclocks before it is moved down a level. Every
+ * SCHED_BOOST_HARDCLOCKS everything goes back to level 0 so nothing
+ * starves; this must be a multiple of SCHEDULE_HARDCLOCKS in clock.c,
+ * as it's checked from schedule().
+ */
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_BOOST_HARDCLOCKS	100
+
+/* c_loadavg is in units of 1/SCHED_LOADSCALE of a thread. */
+#define SCHED_LOADSCALE		256
+
+/* Set once the clock is attached and wakeups can be timed. */
+static bool sched_timing;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -149,6 +168,13 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields */
+	thread->t_level = 0;
+	thread->t_quantum = SCHED_QUANTUM(0);
+	thread->t_woken = false;
+	thread->t_wakesecs = 0;
+	thread->t_wakensecs = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -167,6 +193,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -182,13 +209,39 @@ cpu_create(unsigned hardware_number)
 	c->c_hardclocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueues[i]);
+		c->c_sched_qlensum[i] = 0;
+		c->c_sched_wakeups[i] = 0;
+		c->c_sched_latsum[i] = 0;
+		c->c_sched_latmax[i] = 0;
+	}
+	c->c_runcount = 0;
+	c->c_sched_samples = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
+	c->c_loadavg = 0;
+	c->c_switches = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
+	timer_cpuinit(c);
+
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+#if OPT_A3
+	c->c_pcache_count = 0;
+	c->c_pcache_hits = 0;
+	c->c_pcache_misses = 0;
+	c->c_pcache_refills = 0;
+	c->c_pcache_drains = 0;
+	spinlock_init(&c->c_pcache_lock);
+	c->c_tlbas = NULL;
+	c->c_asid_gen = 0;
+	cpu_tlb_init(&c->c_tlb);
+#endif
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -227,6 +280,25 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus in the system.
+ */
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Get a cpu by its software number.
+ */
+struct cpu *
+cpu_getcpu(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -289,6 +361,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +377,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueues[i].tl_count = 0;
+		curcpu->c_runqueues[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueues[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -416,6 +493,9 @@ thread_start_cpus(void)
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	/* mainbus_bootstrap has attached the clock by now. */
+	sched_timing = true;
+
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,6 +506,151 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue primitives. There is one queue per priority level; the
+ * caller must hold the cpu's runqueue lock.
+ */
+
+/* Queue T behind the other threads at its level. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_level < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueues[t->t_level], t);
+	c->c_runcount++;
+}
+
+/* Take the next thread to run: the first one at the best level. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueues[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last. Used for migration. */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueues[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Return the best level with a thread waiting, or SCHED_NLEVELS. */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueues[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads takes one from the busiest other
+ * cpu instead of going idle. The busiest cpu is the one with the
+ * highest c_loadavg; that is a moving average kept by schedule(), so
+ * a cpu whose queue is only briefly long isn't raided for nothing.
+ * It takes the thread the victim would run last, as that's the one
+ * the victim will miss least.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. But System/161 does not (yet) model such
+ * cache effects, and an idle cpu is the worse loss.
+ *
+ * Called from thread_switch with this cpu marked idle and its run
+ * queue unlocked; holding two run queue locks at once could
+ * deadlock against another cpu stealing the other way. Returns the
+ * stolen thread, which now belongs to this cpu, or NULL.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, numcpus, maxload;
+
+	/* Pick a victim without locking anything; recheck below. */
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_runcount == 0) {
+			continue;
+		}
+		if (victim == NULL || c->c_loadavg > maxload) {
+			victim = c;
+			maxload = c->c_loadavg;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it
+		 *     remained curthread;
+		 *   - it was reawakened, so it was put on the
+		 *     run queue;
+		 *   - and the processor hasn't fully unidled
+		 *     yet, so all these things are still true.
+		 *
+		 * The victim is still running on that thread's stack,
+		 * so taking it would be a disaster. Put it back.
+		 */
+		runqueue_add(victim, t);
+		t = NULL;
+	}
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +675,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -464,6 +689,55 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Make a thread that was asleep on a wait channel runnable. A thread
+ * that blocks is presumed to be waiting for I/O or for a user, so it
+ * moves up a level and gets a fresh quantum; it is also stamped so
+ * thread_switch can measure how long it waits to run.
+ */
+static
+void
+thread_wakeup(struct thread *target)
+{
+	/* Nobody else can see the thread now, so no lock is needed. */
+	if (target->t_level > 0) {
+		target->t_level--;
+	}
+	target->t_quantum = SCHED_QUANTUM(target->t_level);
+	if (sched_timing) {
+		target->t_woken = true;
+		gettime(&target->t_wakesecs, &target->t_wakensecs);
+	}
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Record the wakeup-to-run latency of NEXT, which is about to run on
+ * the current cpu. Called with the runqueue lock held.
+ */
+static
+void
+thread_notelatency(struct thread *next)
+{
+	time_t secs;
+	uint32_t nsecs, lat;
+	unsigned level;
+
+	gettime(&secs, &nsecs);
+	getinterval(next->t_wakesecs, next->t_wakensecs, secs, nsecs,
+		    &secs, &nsecs);
+	lat = secs * 1000000000 + nsecs;
+
+	level = next->t_level;
+	curcpu->c_sched_wakeups[level]++;
+	curcpu->c_sched_latsum[level] += lat;
+	if (lat > curcpu->c_sched_latmax[level]) {
+		curcpu->c_sched_latmax[level] = lat;
+	}
+	next->t_woken = false;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -574,12 +848,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/*
+	 * A thread that yields lets the best of the others go first,
+	 * even if it would outrank them; otherwise a thread spinning
+	 * on thread_yield could keep out the one it's waiting for.
+	 * (Preemption by thread_tick only yields when something at
+	 * least as good is waiting, so this doesn't change its pick.)
+	 */
+	next = NULL;
+	if (newstate == S_READY) {
+		next = runqueue_remhead(curcpu);
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -613,7 +899,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -631,15 +918,26 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
-	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+	while (next == NULL) {
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL) {
+				curcpu->c_steals++;
+			}
 		}
-	} while (next == NULL);
+	}
 	curcpu->c_isidle = false;
+	curcpu->c_switches++;
+
+	if (next->t_woken) {
+		thread_notelatency(next);
+	}
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -822,139 +1120,163 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues and always runs the first thread on the best nonempty
+ * one. A thread that uses up its quantum moves down a level, where
+ * the quantum is twice as long; a thread that sleeps on a wait
+ * channel moves up a level when woken (see thread_wakeup). So
+ * compute-bound threads sink and interactive ones stay near the top.
  */
 
+/*
+ * Charge the current thread for a tick. This is called from
+ * hardclock() on every tick.
+ */
 void
-schedule(void)
+thread_tick(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur;
+	bool preempt;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nobody to charge. */
+		curcpu->c_idleclocks++;
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	if (cur->t_quantum > 0) {
+		cur->t_quantum--;
+	}
+	if (cur->t_quantum == 0) {
+		/* Used up its quantum: move down, and give way to peers. */
+		if (cur->t_level < SCHED_NLEVELS - 1) {
+			cur->t_level++;
+		}
+		cur->t_quantum = SCHED_QUANTUM(cur->t_level);
+		preempt = runqueue_toplevel(curcpu) <= cur->t_level;
+	}
+	else {
+		/* Still has time; give way only to better threads. */
+		preempt = runqueue_toplevel(curcpu) < cur->t_level;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * This is called periodically from hardclock(). It samples the run
+ * queue lengths, updates the load average used by thread_steal, and
+ * every SCHED_BOOST_HARDCLOCKS moves every thread
+ * on this cpu back to level 0 so that compute-bound threads parked
+ * at the bottom are not starved forever by interactive ones.
  */
 void
-thread_consider_migration(void)
+schedule(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
 	struct thread *t;
+	unsigned i, load;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_sched_qlensum[i] += curcpu->c_runqueues[i].tl_count;
 	}
-
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	curcpu->c_sched_samples++;
+
+	/* Runnable threads, counting the one running, weighted 1/4. */
+	load = curcpu->c_runcount + (curcpu->c_isidle ? 0 : 1);
+	curcpu->c_loadavg =
+		(curcpu->c_loadavg * 3 + load * SCHED_LOADSCALE) / 4;
+
+	if ((curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS) == 0) {
+		for (i=1; i<SCHED_NLEVELS; i++) {
+			while ((t = threadlist_remhead(&curcpu->c_runqueues[i]))
+			       != NULL) {
+				t->t_level = 0;
+				t->t_quantum = SCHED_QUANTUM(0);
+				threadlist_addtail(&curcpu->c_runqueues[0], t);
+			}
+		}
+		if (!curcpu->c_isidle) {
+			curthread->t_level = 0;
+			curthread->t_quantum = SCHED_QUANTUM(0);
+		}
 	}
+
 	spinlock_release(&curcpu->c_runqueue_lock);
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+/*
+ * Print scheduler statistics for each cpu.
+ */
+void
+thread_printschedstats(void)
+{
+	struct cpu *c;
+	unsigned i, j, samples, clocks, idleclocks, steals, loadavg;
+	unsigned switches, timers, fired;
+	unsigned qlen[SCHED_NLEVELS], wakeups[SCHED_NLEVELS];
+	uint64_t qlensum[SCHED_NLEVELS], latsum[SCHED_NLEVELS];
+	uint32_t latmax[SCHED_NLEVELS];
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			qlen[j] = c->c_runqueues[j].tl_count;
+			qlensum[j] = c->c_sched_qlensum[j];
+			wakeups[j] = c->c_sched_wakeups[j];
+			latsum[j] = c->c_sched_latsum[j];
+			latmax[j] = c->c_sched_latmax[j];
 		}
+		samples = c->c_sched_samples;
+		clocks = c->c_hardclocks;
+		idleclocks = c->c_idleclocks;
+		steals = c->c_steals;
+		loadavg = c->c_loadavg;
+		switches = c->c_switches;
 		spinlock_release(&c->c_runqueue_lock);
-	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		spinlock_acquire(&c->c_timer_lock);
+		timers = c->c_timer_pending;
+		fired = c->c_timer_fired;
+		spinlock_release(&c->c_timer_lock);
+
+		kprintf("cpu%u: busy %u%% of %u hardclocks, "
+			"load avg %u.%02u, %u threads stolen\n",
+			c->c_number,
+			clocks ? (clocks - idleclocks) * 100 / clocks : 0,
+			clocks, loadavg / SCHED_LOADSCALE,
+			loadavg % SCHED_LOADSCALE * 100 / SCHED_LOADSCALE,
+			steals);
+		kprintf("    %u context switches, %u timers pending, "
+			"%u fired\n", switches, timers, fired);
+		kprintf("    %u run queue samples\n", samples);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf("    level %u: queue length %u, avg %u.%02u; ",
+				j, qlen[j],
+				samples ? (unsigned)(qlensum[j] / samples) : 0,
+				samples ?
+				(unsigned)(qlensum[j] * 100 / samples % 100) :
+				0);
+			if (wakeups[j] == 0) {
+				kprintf("no wakeups\n");
+				continue;
+			}
+			kprintf("%u wakeups, latency avg %u us, max %u us\n",
+				wakeups[j],
+				(unsigned)(latsum[j] / wakeups[j] / 1000),
+				latmax[j] / 1000);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1028,6 +1350,73 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * State shared between wchan_sleep_timeout and its timer.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wchan;
+	struct thread *wt_thread;
+	bool wt_expired;
+};
+
+/*
+ * Timer function for wchan_sleep_timeout: if the thread is still on
+ * the channel, take it off and wake it.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct wchan *wc = wt->wt_wchan;
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	THREADLIST_FORALL(target, wc->wc_threads) {
+		if (target == wt->wt_thread) {
+			threadlist_remove(&wc->wc_threads, target);
+			wt->wt_expired = true;
+			break;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (wt->wt_expired) {
+		thread_wakeup(wt->wt_thread);
+	}
+}
+
+/*
+ * Like wchan_sleep, but give up after TICKS timer ticks if nobody
+ * has woken us. Returns true if it timed out. The channel must be
+ * locked, and will have been unlocked upon return.
+ */
+bool
+wchan_sleep_timeout(struct wchan *wc, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct timer t;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	wt.wt_wchan = wc;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+
+	/*
+	 * Start the timer with the channel still locked, so it can't
+	 * go off before we're on the channel to be woken.
+	 */
+	timer_init(&t, wchan_timeout, &wt);
+	timer_start(&t, ticks);
+	thread_switch(S_SLEEP, wc);
+
+	/* If someone else woke us, the timer may still be pending. */
+	timer_stop(&t);
+	return wt.wt_expired;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,7 +1439,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_wakeup(target);
 }
 
 /*
@@ -1084,7 +1473,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeup(target);
 	}
 
 	threadlist_cleanup(&list);
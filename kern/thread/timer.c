@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel timers.
+ *
+ * Each cpu has a hashed timing wheel: TIMER_WHEELSIZE slots, each a
+ * list of the pending timers whose deadline, modulo the wheel size,
+ * falls there. On every hardclock a cpu steps through the ticks that
+ * have passed since it last looked and runs the timers in each
+ * tick's slot that are due on that tick; a timer more than a turn of
+ * the wheel away just stays put until its turn comes round. So
+ * starting and stopping a timer take constant time, and a tick costs
+ * only the timers that hash to it, not every pending one.
+ *
+ * Lock order: a wait channel may be locked when timer_start is
+ * called, yet timer functions lock wait channels with a timer lock
+ * held. This can't deadlock, because timer_start takes only the
+ * current cpu's timer lock, and a cpu holding a spinlock can't be
+ * interrupted to run its timers.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <timer.h>
+
+/* Deadlines are compared by difference, so they can't be too far off. */
+#define TIMER_MAXTICKS		0x7fffffff
+
+#define TIMER_SLOT(tick)	((tick) & (TIMER_WHEELSIZE - 1))
+
+/* Timer ticks since boot. Only timer_tick changes it. */
+static volatile uint32_t timer_ticks;
+
+/*
+ * Set up the wheel of a new cpu.
+ */
+void
+timer_cpuinit(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<TIMER_WHEELSIZE; i++) {
+		c->c_timerwheel[i] = NULL;
+	}
+	c->c_timer_lastrun = timer_ticks;
+	c->c_timer_pending = 0;
+	c->c_timer_fired = 0;
+	spinlock_init(&c->c_timer_lock);
+}
+
+void
+timer_init(struct timer *t, void (*func)(void *), void *data)
+{
+	t->tm_next = t->tm_prev = NULL;
+	t->tm_cpu = NULL;
+	t->tm_deadline = 0;
+	t->tm_func = func;
+	t->tm_data = data;
+}
+
+/*
+ * Add T to, or take it off, the wheel of C. Called with the timer
+ * lock of C held.
+ */
+static
+void
+timer_link(struct cpu *c, struct timer *t)
+{
+	struct timer **slot;
+
+	slot = &c->c_timerwheel[TIMER_SLOT(t->tm_deadline)];
+	t->tm_prev = NULL;
+	t->tm_next = *slot;
+	if (*slot != NULL) {
+		(*slot)->tm_prev = t;
+	}
+	*slot = t;
+	t->tm_cpu = c;
+	c->c_timer_pending++;
+}
+
+static
+void
+timer_unlink(struct cpu *c, struct timer *t)
+{
+	if (t->tm_prev != NULL) {
+		t->tm_prev->tm_next = t->tm_next;
+	}
+	else {
+		c->c_timerwheel[TIMER_SLOT(t->tm_deadline)] = t->tm_next;
+	}
+	if (t->tm_next != NULL) {
+		t->tm_next->tm_prev = t->tm_prev;
+	}
+	t->tm_next = t->tm_prev = NULL;
+	c->c_timer_pending--;
+}
+
+void
+timer_start(struct timer *t, unsigned ticks)
+{
+	struct cpu *c;
+
+	KASSERT(t->tm_cpu == NULL);
+	KASSERT(ticks > 0 && ticks <= TIMER_MAXTICKS);
+
+	/*
+	 * If we get moved to another cpu after this, the timer ends up
+	 * on a cpu we're not on. That's fine; it still goes off.
+	 */
+	c = curcpu->c_self;
+
+	spinlock_acquire(&c->c_timer_lock);
+	t->tm_deadline = timer_ticks + ticks;
+	timer_link(c, t);
+	spinlock_release(&c->c_timer_lock);
+}
+
+bool
+timer_stop(struct timer *t)
+{
+	struct cpu *c;
+	bool pending;
+
+	/*
+	 * tm_cpu is cleared, under the timer lock, only once the timer
+	 * has gone off and its function has returned. So if it's
+	 * already NULL there's nothing to wait for; otherwise, lock
+	 * and check again.
+	 */
+	c = t->tm_cpu;
+	if (c == NULL) {
+		return false;
+	}
+
+	spinlock_acquire(&c->c_timer_lock);
+	pending = t->tm_cpu != NULL;
+	if (pending) {
+		KASSERT(t->tm_cpu == c);
+		timer_unlink(c, t);
+		t->tm_cpu = NULL;
+	}
+	spinlock_release(&c->c_timer_lock);
+
+	return pending;
+}
+
+/*
+ * Count a tick. This is called from timerclock(), on one cpu.
+ */
+void
+timer_tick(void)
+{
+	timer_ticks++;
+}
+
+/*
+ * Run the timers on this cpu that have come due. This is called from
+ * hardclock(); with HZ above the timer tick rate, most calls find no
+ * tick has passed and return without locking anything.
+ */
+void
+timer_runwheel(void)
+{
+	struct cpu *c;
+	struct timer *t, *next;
+	uint32_t now, tick;
+
+	c = curcpu->c_self;
+	now = timer_ticks;
+
+	/* Only this cpu changes c_timer_lastrun. */
+	if (c->c_timer_lastrun == now) {
+		return;
+	}
+
+	spinlock_acquire(&c->c_timer_lock);
+	while (c->c_timer_lastrun != now) {
+		tick = ++c->c_timer_lastrun;
+		for (t = c->c_timerwheel[TIMER_SLOT(tick)]; t != NULL;
+		     t = next) {
+			next = t->tm_next;
+			if (t->tm_deadline != tick) {
+				/* Not this time round. */
+				continue;
+			}
+			timer_unlink(c, t);
+			t->tm_func(t->tm_data);
+			t->tm_cpu = NULL;
+			c->c_timer_fired++;
+		}
+	}
+	spinlock_release(&c->c_timer_lock);
+}
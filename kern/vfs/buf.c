@@ -0,0 +1,821 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ *
+ * Buffers are found through a hash table on (device, block) and kept
+ * on one list in least-recently-released order, which eviction walks
+ * from the tail. buffer_lock protects all of it and every buffer's
+ * header, but is never held across disk I/O: a buffer being read or
+ * written is marked busy instead, and threads that want it wait on
+ * buffer_cv.
+ *
+ * The cache grows one buffer at a time up to buffer_max, which is
+ * set at boot to a fixed share of the free physical memory.
+ *
+ * buffer_sync hands a device all its dirty buffers at once if it can
+ * queue requests (d_submit), so the disk can put them in order, and
+ * then waits for them on buffer_iowchan.
+ *
+ * buffer_readahead starts reading a block and returns without waiting.
+ * The buffer stays busy, with b_async set, until the first thread to
+ * want it after the read completes finishes it off; the completion
+ * itself happens in an interrupt handler and can't take buffer_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vm.h>
+#include <device.h>
+#include <buf.h>
+#include "opt-A3.h"
+
+#define BUFFER_HASHSIZE		256	/* buckets; a power of two */
+#define BUFFER_MEMSHARE		16	/* use 1/16 of free memory */
+#define BUFFER_MIN		32	/* but never fewer buffers */
+#define BUFFER_MAXTRIES		10	/* tries on a disk error */
+
+struct buf {
+	struct device *b_dev;		/* NULL if the buffer holds nothing */
+	daddr_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* held by some thread */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev;		/* more recently released */
+	struct buf *b_lrunext;		/* less recently released */
+	struct buf *b_ionext;		/* in a buffer_sync batch */
+	struct devreq b_req;		/* for d_submit */
+	bool b_iodone;			/* b_req finished */
+	int b_ioresult;
+	bool b_async;			/* busy with a read-ahead */
+	bool b_ra;			/* read ahead and not used yet */
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;		/* a buffer stopped being busy */
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead, *buffer_lrutail;
+static unsigned buffer_count, buffer_max, buffer_ndirty;
+static unsigned buffer_hits, buffer_misses, buffer_writebacks;
+static unsigned buffer_raissued, buffer_raused, buffer_rawasted;
+static struct spinlock buffer_iolock;	/* for b_iodone, b_ioresult */
+static struct wchan *buffer_iowchan;	/* a b_req finished */
+
+#define BUFFER_HASH(dev, block) \
+	((((uintptr_t)(dev) >> 4) ^ (block)) & (BUFFER_HASHSIZE - 1))
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lru_addhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+static
+void
+buffer_lru_addtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[BUFFER_HASH(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/* Give b an identity and make it findable. */
+static
+void
+buffer_attach(struct buf *b, struct device *dev, daddr_t block)
+{
+	unsigned h = BUFFER_HASH(dev, block);
+
+	KASSERT(b->b_dev == NULL);
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_ra = false;
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+/* Forget what b holds, dirty or not. */
+static
+void
+buffer_detach(struct buf *b)
+{
+	struct buf **bp;
+
+	if (b->b_dev == NULL) {
+		return;
+	}
+	for (bp = &buffer_hash[BUFFER_HASH(b->b_dev, b->b_block)]; *bp != b;
+	     bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	if (b->b_dirty) {
+		buffer_ndirty--;
+	}
+	if (b->b_ra) {
+		buffer_rawasted++;
+		b->b_ra = false;
+	}
+	b->b_dev = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Read or write b's block. Call with b busy and buffer_lock not held.
+ * Errors are retried a few times in case they're transient.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result, tries;
+
+	KASSERT(b->b_busy);
+
+	for (tries = 1; ; tries++) {
+		uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+			  (off_t)b->b_block * BUFFER_SIZE, rw);
+		result = b->b_dev->d_io(b->b_dev, &ku);
+		if (result == EINVAL) {
+			/* out of range or misaligned; that's our fault */
+			panic("buffer: d_io returned EINVAL\n");
+		}
+		if (result != EIO || tries == BUFFER_MAXTRIES) {
+			break;
+		}
+		if (tries == 1) {
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+		}
+	}
+	if (result == EIO) {
+		kprintf("buffer: block %u I/O error, giving up after "
+			"%d tries\n", b->b_block, tries);
+	}
+	return result;
+}
+
+/* dr_done for b_req. May be called in an interrupt handler. */
+static
+void
+buffer_iodone(struct devreq *dr, int result)
+{
+	struct buf *b = dr->dr_arg;
+
+	spinlock_acquire(&buffer_iolock);
+	b->b_ioresult = result;
+	b->b_iodone = true;
+	wchan_wakeall(buffer_iowchan);
+	spinlock_release(&buffer_iolock);
+}
+
+/*
+ * Write a list (linked by b_ionext) of busy buffers. Where the device
+ * can queue them, start them all and then wait, and only fall back
+ * to buffer_io, with its retries, for ones that fail. Call with
+ * buffer_lock not held. Returns the first error; b_ioresult says
+ * which buffers made it.
+ */
+static
+int
+buffer_writelist(struct buf *list)
+{
+	struct buf *b;
+	int result, ret = 0;
+
+	for (b = list; b != NULL; b = b->b_ionext) {
+		KASSERT(b->b_busy && b->b_dirty);
+		b->b_iodone = false;
+		b->b_ioresult = ENODEV;
+		if (b->b_dev->d_submit == NULL) {
+			continue;
+		}
+		b->b_req.dr_block = b->b_block;
+		b->b_req.dr_nblocks = 1;
+		b->b_req.dr_write = true;
+		b->b_req.dr_data = b->b_data;
+		b->b_req.dr_done = buffer_iodone;
+		b->b_req.dr_arg = b;
+		result = b->b_dev->d_submit(b->b_dev, &b->b_req);
+		if (result) {
+			b->b_iodone = true;
+			b->b_ioresult = result;
+		}
+	}
+
+	for (b = list; b != NULL; b = b->b_ionext) {
+		if (b->b_dev->d_submit != NULL) {
+			spinlock_acquire(&buffer_iolock);
+			while (!b->b_iodone) {
+				/* wchan_sleep unlocks the wchan */
+				wchan_lock(buffer_iowchan);
+				spinlock_release(&buffer_iolock);
+				wchan_sleep(buffer_iowchan);
+				spinlock_acquire(&buffer_iolock);
+			}
+			spinlock_release(&buffer_iolock);
+		}
+		if (b->b_ioresult != 0) {
+			/* not queued, or it failed; do it the slow way */
+			b->b_ioresult = buffer_io(b, UIO_WRITE);
+		}
+		if (b->b_ioresult != 0 && ret == 0) {
+			ret = b->b_ioresult;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Write back a dirty buffer that we have made busy. Called with
+ * buffer_lock held; drops it during the I/O.
+ */
+static
+int
+buffer_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy && b->b_dirty);
+
+	lock_release(buffer_lock);
+	result = buffer_io(b, UIO_WRITE);
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		b->b_dirty = false;
+		buffer_ndirty--;
+		buffer_writebacks++;
+	}
+	return result;
+}
+
+/* Stop holding b. Call with buffer_lock held. */
+static
+void
+buffer_unbusy(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+/* Whether b's read-ahead has completed. */
+static
+bool
+buffer_asyncdone(struct buf *b)
+{
+	bool done;
+
+	spinlock_acquire(&buffer_iolock);
+	done = b->b_iodone;
+	spinlock_release(&buffer_iolock);
+	return done;
+}
+
+/*
+ * Wrap up a completed read-ahead and let go of the buffer. Call with
+ * buffer_lock held.
+ */
+static
+void
+buffer_finishasync(struct buf *b)
+{
+	KASSERT(b->b_busy && b->b_async);
+	KASSERT(buffer_asyncdone(b));
+
+	b->b_async = false;
+	if (b->b_ioresult == 0) {
+		b->b_valid = true;
+		b->b_ra = true;
+	}
+	else {
+		/* never mind; a real read will retry it */
+		buffer_detach(b);
+	}
+	buffer_unbusy(b);
+}
+
+/*
+ * Wait for b's read-ahead to complete and wrap it up. Called with
+ * buffer_lock held; drops it while waiting.
+ */
+static
+void
+buffer_waitasync(struct buf *b)
+{
+	KASSERT(b->b_async);
+
+	lock_release(buffer_lock);
+	spinlock_acquire(&buffer_iolock);
+	while (!b->b_iodone) {
+		/* wchan_sleep unlocks the wchan */
+		wchan_lock(buffer_iowchan);
+		spinlock_release(&buffer_iolock);
+		wchan_sleep(buffer_iowchan);
+		spinlock_acquire(&buffer_iolock);
+	}
+	spinlock_release(&buffer_iolock);
+	lock_acquire(buffer_lock);
+
+	/* someone else may have got here first */
+	if (b->b_async && buffer_asyncdone(b)) {
+		buffer_finishasync(b);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lookup and eviction
+
+/* Allocate a new, empty buffer if we are still below buffer_max. */
+static
+struct buf *
+buffer_create(void)
+{
+	struct buf *b;
+
+	if (buffer_count >= buffer_max) {
+		return NULL;
+	}
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_valid = b->b_dirty = b->b_busy = false;
+	b->b_async = b->b_ra = false;
+	b->b_hashnext = NULL;
+	buffer_lru_addhead(b);
+	buffer_count++;
+	return b;
+}
+
+/*
+ * Find block of dev in the cache or find a buffer to put it in, and
+ * return it busy. Called with buffer_lock held; may drop it to wait
+ * or to write back a victim.
+ */
+static
+int
+buffer_getbusy(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+ again:
+	b = buffer_find(dev, block);
+	if (b != NULL) {
+		if (b->b_busy && b->b_async) {
+			buffer_waitasync(b);
+			goto again;
+		}
+		if (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		b->b_busy = true;
+		*ret = b;
+		return 0;
+	}
+
+	b = buffer_create();
+	if (b == NULL) {
+		/* take the least recently used buffer nobody holds */
+		for (b = buffer_lrutail; b != NULL; b = b->b_lruprev) {
+			if (b->b_busy && b->b_async && buffer_asyncdone(b)) {
+				buffer_finishasync(b);
+			}
+			if (!b->b_busy) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			if (buffer_count == 0) {
+				return ENOMEM;
+			}
+			cv_wait(buffer_cv, buffer_lock);
+			goto again;
+		}
+		b->b_busy = true;
+		if (b->b_dirty) {
+			result = buffer_writeback(b);
+			buffer_unbusy(b);
+			if (result) {
+				return result;
+			}
+			/* we slept; someone may have cached our block */
+			goto again;
+		}
+		buffer_detach(b);
+	}
+	b->b_busy = true;
+	buffer_attach(b, dev, block);
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+buffer_bootstrap(void)
+{
+	buffer_lock = lock_create("buffer cache");
+	buffer_cv = cv_create("buffer cache");
+	buffer_iowchan = wchan_create("buffer I/O");
+	if (buffer_lock == NULL || buffer_cv == NULL ||
+	    buffer_iowchan == NULL) {
+		panic("buffer_bootstrap: out of memory\n");
+	}
+	spinlock_init(&buffer_iolock);
+
+#if OPT_A3
+	buffer_max = coremap_freepages() * (PAGE_SIZE / BUFFER_SIZE) /
+		BUFFER_MEMSHARE;
+#endif
+	if (buffer_max < BUFFER_MIN) {
+		buffer_max = BUFFER_MIN;
+	}
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_getbusy(dev, block, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+	if (b->b_valid) {
+		buffer_hits++;
+		if (b->b_ra) {
+			buffer_raused++;
+			b->b_ra = false;
+		}
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+	buffer_misses++;
+	lock_release(buffer_lock);
+
+	result = buffer_io(b, UIO_READ);
+
+	lock_acquire(buffer_lock);
+	if (result) {
+		buffer_detach(b);
+		buffer_unbusy(b);
+		lock_release(buffer_lock);
+		return result;
+	}
+	b->b_valid = true;
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_getbusy(dev, block, ret);
+	if (result == 0 && !(*ret)->b_valid) {
+		/* don't let a caller that fails halfway leak the old data */
+		bzero((*ret)->b_data, BUFFER_SIZE);
+	}
+	if (result == 0) {
+		/* it's about to be overwritten, not used */
+		(*ret)->b_ra = false;
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+bool
+buffer_readahead(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	if (dev->d_submit == NULL) {
+		/* can't do it without waiting */
+		return false;
+	}
+
+	lock_acquire(buffer_lock);
+	if (buffer_find(dev, block) != NULL) {
+		/* already there, or on its way */
+		lock_release(buffer_lock);
+		return false;
+	}
+
+	b = buffer_create();
+	if (b == NULL) {
+		/* a guess isn't worth waiting or writing anything back for */
+		for (b = buffer_lrutail; b != NULL; b = b->b_lruprev) {
+			if (!b->b_busy && !b->b_dirty) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			lock_release(buffer_lock);
+			return false;
+		}
+		buffer_detach(b);
+	}
+	b->b_busy = true;
+	b->b_async = true;
+	buffer_attach(b, dev, block);
+
+	/* don't let it be the next thing evicted */
+	buffer_lru_remove(b);
+	buffer_lru_addhead(b);
+	buffer_raissued++;
+
+	b->b_iodone = false;
+	b->b_ioresult = 0;
+	b->b_req.dr_block = block;
+	b->b_req.dr_nblocks = 1;
+	b->b_req.dr_write = false;
+	b->b_req.dr_data = b->b_data;
+	b->b_req.dr_done = buffer_iodone;
+	b->b_req.dr_arg = b;
+	lock_release(buffer_lock);
+
+	result = dev->d_submit(dev, &b->b_req);
+	if (result) {
+		/* wake anyone already waiting for it, then drop it */
+		buffer_iodone(&b->b_req, result);
+		lock_acquire(buffer_lock);
+		if (b->b_async) {
+			buffer_finishasync(b);
+		}
+		lock_release(buffer_lock);
+		return false;
+	}
+	return true;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		buffer_ndirty++;
+	}
+	b->b_valid = true;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	if (!b->b_valid) {
+		/* got with buffer_get and never filled in */
+		buffer_detach(b);
+	}
+	buffer_lru_remove(b);
+	if (b->b_dev != NULL) {
+		buffer_lru_addhead(b);
+	}
+	else {
+		buffer_lru_addtail(b);
+	}
+	buffer_unbusy(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		if (b->b_async) {
+			buffer_waitasync(b);
+		}
+		else {
+			cv_wait(buffer_cv, buffer_lock);
+		}
+	}
+	if (b != NULL) {
+		buffer_detach(b);
+		/* reuse it first */
+		buffer_lru_remove(b);
+		buffer_lru_addtail(b);
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b, *list;
+	int result;
+
+	lock_acquire(buffer_lock);
+	/*
+	 * Other threads may dirty more buffers while we write, so keep
+	 * making passes until one finds nothing to write.
+	 */
+	while (buffer_ndirty > 0) {
+		list = NULL;
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (!b->b_dirty || b->b_busy ||
+			    (dev != NULL && b->b_dev != dev)) {
+				continue;
+			}
+			/* b stays on the LRU list while it is busy */
+			b->b_busy = true;
+			b->b_ionext = list;
+			list = b;
+		}
+		if (list == NULL) {
+			break;
+		}
+
+		lock_release(buffer_lock);
+		result = buffer_writelist(list);
+		lock_acquire(buffer_lock);
+
+		for (b = list; b != NULL; b = b->b_ionext) {
+			if (b->b_ioresult == 0) {
+				b->b_dirty = false;
+				buffer_ndirty--;
+				buffer_writebacks++;
+			}
+			buffer_unbusy(b);
+		}
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_purge(struct device *dev)
+{
+	struct buf *b, *next;
+
+	lock_acquire(buffer_lock);
+ again:
+	/* let any read-ahead still in flight land first */
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev == dev && b->b_async) {
+			buffer_waitasync(b);
+			goto again;
+		}
+	}
+	for (b = buffer_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		buffer_detach(b);
+		buffer_lru_remove(b);
+		kfree(b->b_data);
+		kfree(b);
+		buffer_count--;
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	lock_acquire(buffer_lock);
+	kprintf("Buffer cache: %u of %u buffers, %u dirty\n",
+		buffer_count, buffer_max, buffer_ndirty);
+	kprintf("    %u hits, %u misses, %u written back\n",
+		buffer_hits, buffer_misses, buffer_writebacks);
+	kprintf("    read-ahead: %u started, %u used, %u evicted unused\n",
+		buffer_raissued, buffer_raused, buffer_rawasted);
+	lock_release(buffer_lock);
+}
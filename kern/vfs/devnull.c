@@ -112,6 +112,8 @@ devnull_create(void)
 	dev->d_close = nullclose;
 	dev->d_io = nullio;
 	dev->d_ioctl = nullioctl;
+	dev->d_submit = NULL;
+	dev->d_printstats = NULL;
 
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
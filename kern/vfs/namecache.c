@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name cache.
+ *
+ * A fixed pool of entries, found through a hash table on (directory,
+ * name) and kept on one list in least-recently-used order; unused
+ * entries sit at the tail, and a new entry takes the tail's place.
+ * An entry holds a reference to its directory and, unless it is
+ * negative, to the vnode the name leads to. nc_lock protects all of
+ * it, but references are dropped only after letting go of nc_lock,
+ * since that can reclaim a vnode.
+ *
+ * nc_gen counts removals. A lookup that misses notes it, and its
+ * result isn't entered if a name was removed in between, so a
+ * lookup racing with a create or remove can't cache a stale answer.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <fs.h>
+#include <vnode.h>
+#include <namecache.h>
+
+#define NC_SIZE		128	/* entries */
+#define NC_HASHSIZE	64	/* buckets */
+#define NC_NAMELEN	31	/* longer names aren't cached */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* NULL if the entry is unused */
+	struct vnode *nc_vn;		/* NULL for a negative entry */
+	char nc_name[NC_NAMELEN+1];
+	struct ncentry *nc_hashnext;
+	struct ncentry *nc_lruprev;	/* more recently used */
+	struct ncentry *nc_lrunext;	/* less recently used */
+};
+
+static struct lock *nc_lock;
+static struct ncentry *nc_hash[NC_HASHSIZE];
+static struct ncentry *nc_lruhead, *nc_lrutail;
+static unsigned nc_gen;
+static unsigned nc_hits, nc_neghits, nc_misses;
+
+static
+unsigned
+nc_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name != 0) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h % NC_HASHSIZE;
+}
+
+/* Whether lookups of NAME in DIR may be cached at all. */
+static
+bool
+nc_cacheable(struct vnode *dir, const char *name)
+{
+	return dir->vn_fs != NULL && dir->vn_fs->fs_namecache &&
+		strlen(name) <= NC_NAMELEN;
+}
+
+static
+void
+nc_lru_remove(struct ncentry *e)
+{
+	if (e->nc_lruprev != NULL) {
+		e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	}
+	else {
+		nc_lruhead = e->nc_lrunext;
+	}
+	if (e->nc_lrunext != NULL) {
+		e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+	}
+	else {
+		nc_lrutail = e->nc_lruprev;
+	}
+	e->nc_lruprev = e->nc_lrunext = NULL;
+}
+
+static
+void
+nc_lru_addhead(struct ncentry *e)
+{
+	e->nc_lruprev = NULL;
+	e->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = e;
+	}
+	else {
+		nc_lrutail = e;
+	}
+	nc_lruhead = e;
+}
+
+static
+void
+nc_lru_addtail(struct ncentry *e)
+{
+	e->nc_lrunext = NULL;
+	e->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = e;
+	}
+	else {
+		nc_lruhead = e;
+	}
+	nc_lrutail = e;
+}
+
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+
+	for (e = nc_hash[nc_hashfn(dir, name)]; e != NULL;
+	     e = e->nc_hashnext) {
+		if (e->nc_dir == dir && !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Make E unused and hand back the references it held, for the caller
+ * to drop once it has released nc_lock.
+ */
+static
+void
+nc_detach(struct ncentry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **ep;
+
+	KASSERT(e->nc_dir != NULL);
+	for (ep = &nc_hash[nc_hashfn(e->nc_dir, e->nc_name)]; *ep != e;
+	     ep = &(*ep)->nc_hashnext) {
+		KASSERT(*ep != NULL);
+	}
+	*ep = e->nc_hashnext;
+	e->nc_hashnext = NULL;
+
+	*dir = e->nc_dir;
+	*vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+
+	/* reuse it first */
+	nc_lru_remove(e);
+	nc_lru_addtail(e);
+}
+
+/* Drop the references nc_detach handed back. */
+static
+void
+nc_release(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+void
+namecache_bootstrap(void)
+{
+	struct ncentry *e;
+	unsigned i;
+
+	nc_lock = lock_create("namecache");
+	if (nc_lock == NULL) {
+		panic("namecache_bootstrap: out of memory\n");
+	}
+
+	for (i=0; i<NC_SIZE; i++) {
+		e = kmalloc(sizeof(*e));
+		if (e == NULL) {
+			panic("namecache_bootstrap: out of memory\n");
+		}
+		e->nc_dir = NULL;
+		e->nc_vn = NULL;
+		e->nc_hashnext = NULL;
+		nc_lru_addtail(e);
+	}
+}
+
+bool
+namecache_lookup(struct vnode *dir, const char *name,
+		 struct vnode **ret, unsigned *gen)
+{
+	struct ncentry *e;
+
+	*gen = 0;
+	if (!nc_cacheable(dir, name)) {
+		return false;
+	}
+
+	lock_acquire(nc_lock);
+	e = nc_find(dir, name);
+	if (e == NULL) {
+		nc_misses++;
+		*gen = nc_gen;
+		lock_release(nc_lock);
+		return false;
+	}
+
+	nc_lru_remove(e);
+	nc_lru_addhead(e);
+	*ret = e->nc_vn;
+	if (e->nc_vn != NULL) {
+		VOP_INCREF(e->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	lock_release(nc_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name,
+		struct vnode *vn, unsigned gen)
+{
+	struct ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (!nc_cacheable(dir, name)) {
+		return;
+	}
+
+	lock_acquire(nc_lock);
+	if (gen != nc_gen || nc_find(dir, name) != NULL) {
+		/* stale, or someone beat us to it */
+		lock_release(nc_lock);
+		return;
+	}
+
+	e = nc_lrutail;
+	if (e->nc_dir != NULL) {
+		nc_detach(e, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	e->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_vn = vn;
+	strcpy(e->nc_name, name);
+
+	e->nc_hashnext = nc_hash[nc_hashfn(dir, name)];
+	nc_hash[nc_hashfn(dir, name)] = e;
+	nc_lru_remove(e);
+	nc_lru_addhead(e);
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+void
+namecache_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (dir->vn_fs == NULL || !dir->vn_fs->fs_namecache) {
+		return;
+	}
+
+	lock_acquire(nc_lock);
+	nc_gen++;
+	if (strlen(name) <= NC_NAMELEN) {
+		e = nc_find(dir, name);
+		if (e != NULL) {
+			nc_detach(e, &olddir, &oldvn);
+		}
+	}
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+void
+namecache_purge(struct fs *fs)
+{
+	struct ncentry *e;
+	struct vnode *olddir, *oldvn;
+
+	/* one at a time, since dropping references needs nc_lock free */
+	do {
+		olddir = oldvn = NULL;
+		lock_acquire(nc_lock);
+		nc_gen++;
+		for (e = nc_lruhead; e != NULL; e = e->nc_lrunext) {
+			if (e->nc_dir != NULL && e->nc_dir->vn_fs == fs) {
+				nc_detach(e, &olddir, &oldvn);
+				break;
+			}
+		}
+		lock_release(nc_lock);
+		nc_release(olddir, oldvn);
+	} while (olddir != NULL);
+}
+
+void
+namecache_printstats(void)
+{
+	lock_acquire(nc_lock);
+	kprintf("Name cache: %u hits, %u negative hits, %u misses\n",
+		nc_hits, nc_neghits, nc_misses);
+	lock_release(nc_lock);
+}
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <namecache.h>
 
 /*
  * Structure for a single named device.
@@ -87,6 +88,14 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * knowndevs, and the kd_fs of each device, are only changed with both
+ * the big lock and knowndevs_lock (for writing) held, so holding
+ * either one is enough to look at them. Path lookups take
+ * knowndevs_lock for reading so they don't serialize on the big lock.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,12 +112,19 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
 	vfs_biglock_depth = 0;
 
+	namecache_bootstrap();
+
 	devnull_create();
 }
 
@@ -174,12 +190,14 @@ vfs_sync(void)
  * back an appropriate vnode.
  */
 int
-vfs_getroot(const char *devname, struct vnode **result)
+vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
+	result = ENODEV;
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -200,14 +218,16 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				*result = FSOP_GETROOT(kd->kd_fs);
-				return 0;
+				*ret = FSOP_GETROOT(kd->kd_fs);
+				result = 0;
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -221,8 +241,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_rawname==NULL);
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -232,8 +253,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -244,10 +266,12 @@ vfs_getroot(const char *devname, struct vnode **result)
 	}
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * If we got to the end, the device specified by devname
+	 * doesn't exist.
 	 */
 
-	return ENODEV;
+	rwlock_release_read(knowndevs_lock);
+	return result;
 }
 
 /*
@@ -257,11 +281,13 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
+	name = NULL;
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,11 +300,36 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	rwlock_release_read(knowndevs_lock);
+	return name;
+}
+
+/*
+ * Print the statistics of each known device that keeps any.
+ */
+void
+vfs_printdevstats(void)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	rwlock_acquire_read(knowndevs_lock);
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_device != NULL &&
+		    kd->kd_device->d_printstats != NULL) {
+			kd->kd_device->d_printstats(kd->kd_device);
+		}
+	}
+
+	rwlock_release_read(knowndevs_lock);
 }
 
 /*
@@ -416,7 +467,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		return EEXIST;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	result = knowndevarray_add(knowndevs, kd, &index);
+	rwlock_release_write(knowndevs_lock);
 
 	if (result == 0 && dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
@@ -470,7 +523,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold the big lock.
  */
 static
 int
@@ -537,7 +590,9 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_release_write(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -571,14 +626,23 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/*
+	 * Keep lookups from finding the filesystem's root while we
+	 * decide whether it's in use.
+	 */
+	rwlock_acquire_write(knowndevs_lock);
+
+	/* let go of the vnodes the name cache holds */
+	namecache_purge(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
-		goto fail;
+		goto unlock;
 	}
 
 	result = FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
-		goto fail;
+		goto unlock;
 	}
 
 	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
@@ -588,6 +652,8 @@ vfs_unmount(const char *devname)
 
 	KASSERT(result==0);
 
+ unlock:
+	rwlock_release_write(knowndevs_lock);
  fail:
 	vfs_biglock_release();
 	return result;
@@ -604,6 +670,7 @@ vfs_unmountall(void)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -619,6 +686,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		namecache_purge(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -650,6 +719,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 
 	return 0;
@@ -35,12 +35,20 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <namecache.h>
 
+/*
+ * bootfs_vnode is changed under the big lock, but read by path
+ * lookups without it, so the pointer itself is guarded by a spinlock
+ * that's held while taking a reference to it.
+ */
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +59,12 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	KASSERT(vfs_biglock_do_i_hold());
+
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -133,8 +145,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +198,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -235,11 +248,13 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
+	/*
+	 * getdevice looks at the device table and bootfs under their
+	 * own locks; the lookup itself is left to the filesystem's own
+	 * locking.
+	 */
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -257,7 +272,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -265,25 +279,32 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	unsigned gen;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	if (namecache_lookup(startvn, path, retval, &gen)) {
+		VOP_DECREF(startvn);
+		return *retval == NULL ? ENOENT : 0;
+	}
+
 	result = VOP_LOOKUP(startvn, path, retval);
+	if (result == 0) {
+		namecache_enter(startvn, path, *retval, gen);
+	}
+	else if (result == ENOENT) {
+		namecache_enter(startvn, path, NULL, gen);
+	}
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
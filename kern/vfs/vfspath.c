@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <namecache.h>
 
 
 /* Does most of the work for open(). */
@@ -67,13 +68,24 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		char name[NAME_MAX+1];
 		struct vnode *dir;
 		int excl = (openflags & O_EXCL)!=0;
+		unsigned gen;
 		
 		result = vfs_lookparent(path, &dir, name, sizeof(name));
 		if (result) {
 			return result;
 		}
 
-		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		/*
+		 * If the name is known to exist and that's all right,
+		 * skip VOP_CREAT's trip through the directory.
+		 */
+		if (!excl && namecache_lookup(dir, name, &vn, &gen) &&
+		    vn != NULL) {
+			result = 0;
+		}
+		else {
+			result = VOP_CREAT(dir, name, excl, mode, &vn);
+		}
 
 		VOP_DECREF(dir);
 	}
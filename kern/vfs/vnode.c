@@ -51,6 +51,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
 	return 0;
@@ -66,6 +67,7 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	spinlock_cleanup(&vn->vn_countlock);
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -83,17 +85,20 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
  * Calls VOP_RECLAIM if the refcount hits zero.
+ *
+ * The last reference is handed to VOP_RECLAIM still counted, and
+ * without the count lock held; the filesystem must recheck the count
+ * against its own vnode table lock, since someone may have found the
+ * vnode again in the meantime, and drop the reference itself if so.
  */
 void
 vnode_decref(struct vnode *vn)
@@ -102,22 +107,21 @@ vnode_decref(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		spinlock_release(&vn->vn_countlock);
+		return;
 	}
-	else {
-		result = VOP_RECLAIM(vn);
-		if (result != 0 && result != EBUSY) {
-			// XXX: lame.
-			kprintf("vfs: Warning: VOP_RECLAIM: %s\n",
-				strerror(result));
-		}
-	}
+	spinlock_release(&vn->vn_countlock);
 
-	vfs_biglock_release();
+	result = VOP_RECLAIM(vn);
+	if (result != 0 && result != EBUSY) {
+		// XXX: lame.
+		kprintf("vfs: Warning: VOP_RECLAIM: %s\n",
+			strerror(result));
+	}
 }
 
 /*
@@ -129,9 +133,9 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -145,16 +149,18 @@ vnode_decopen(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
 
 	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+		spinlock_release(&vn->vn_countlock);
 		return;
 	}
 
+	spinlock_release(&vn->vn_countlock);
+
 	result = VOP_CLOSE(vn);
 	if (result) {
 		// XXX: also lame.
@@ -162,8 +168,6 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -173,7 +177,7 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
+	int refcount, opencount;
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -202,26 +206,29 @@ vnode_check(struct vnode *v, const char *opstr)
 		panic("vnode_check: vop_%s: deadbeef fs pointer\n", opstr);
 	}
 
-	if (v->vn_refcount < 0) {
+	spinlock_acquire(&v->vn_countlock);
+	refcount = v->vn_refcount;
+	opencount = v->vn_opencount;
+	spinlock_release(&v->vn_countlock);
+
+	if (refcount < 0) {
 		panic("vnode_check: vop_%s: negative refcount %d\n", opstr,
-		      v->vn_refcount);
+		      refcount);
 	}
-	else if (v->vn_refcount == 0 && strcmp(opstr, "reclaim")) {
+	else if (refcount == 0 && strcmp(opstr, "reclaim")) {
 		panic("vnode_check: vop_%s: zero refcount\n", opstr);
 	}
-	else if (v->vn_refcount > 0x100000) {
+	else if (refcount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large refcount %d\n", 
-			opstr, v->vn_refcount);
+			opstr, refcount);
 	}
 
-	if (v->vn_opencount < 0) {
+	if (opencount < 0) {
 		panic("vnode_check: vop_%s: negative opencount %d\n", opstr,
-		      v->vn_opencount);
+		      opencount);
 	}
-	else if (v->vn_opencount > 0x100000) {
+	else if (opencount > 0x100000) {
 		kprintf("vnode_check: vop_%s: warning: large opencount %d\n", 
-			opstr, v->vn_opencount);
+			opstr, opencount);
 	}
-
-	vfs_biglock_release();
 }
@@ -41,6 +41,27 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Size of the stdout buffer */
+#define BUFSIZ 1024
+
+/*
+ * Standard output stream. Output is buffered: a line at a time on the
+ * console, a buffer at a time into a regular file. There is no stdin
+ * or stderr stream; getchar and the err functions use the file
+ * descriptors directly.
+ */
+typedef struct __file FILE;
+extern FILE *stdout;
+
+/* Write out f's buffered output, or every stream's if f is NULL. */
+int fflush(FILE *f);
+
+/*
+ * Append data to f's buffer, writing it out as needed
+ * (for libc internal use only)
+ */
+int __stdio_send(FILE *f, const char *data, size_t len);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -42,12 +42,9 @@ static
 void
 __printf_send(void *mydata, const char *data, size_t len)
 {
-	unsigned i;
 	(void)mydata;  /* not needed */
 
-	for (i=0; i<len; i++) {
-		putchar(data[i]);
-	}
+	__stdio_send(stdout, data, len);
 }
 
 /* printf: hand off to vprintf */
@@ -41,9 +41,8 @@ int
 putchar(int ch)
 {
 	char c = ch;
-	int len;
-	len = write(STDOUT_FILENO, &c, 1);
-	if (len<=0) {
+
+	if (__stdio_send(stdout, &c, 1)) {
 		return EOF;
 	}
 	return ch;
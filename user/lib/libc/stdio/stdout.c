@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Buffered standard output.
+ *
+ * All of printf, puts and putchar go through __stdio_send, which
+ * collects output in the buffer of stdout and hands it to write() a
+ * buffer at a time instead of a character at a time. stdout is the
+ * console, so the buffer is written at the end of every line as well
+ * as when it fills up, and interactive output appears when it is
+ * expected to. (There is no fstat to tell us otherwise.)
+ *
+ * Output still in the buffer is written by fflush, by exit, before
+ * getchar reads input and before fork, so the child doesn't inherit a
+ * copy of it.
+ */
+
+struct __file {
+	int f_fd;
+	size_t f_len;			/* bytes waiting in f_buf */
+	char f_buf[BUFSIZ];
+};
+
+static FILE __stdout = { STDOUT_FILENO, 0, { 0 } };
+FILE *stdout = &__stdout;
+
+/*
+ * Write all of data to f's file. Returns 0, or EOF on error.
+ */
+static
+int
+__stdio_write(FILE *f, const char *data, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(f->f_fd, data, len);
+		if (r <= 0) {
+			return EOF;
+		}
+		data += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int
+fflush(FILE *f)
+{
+	int result;
+
+	if (f == NULL) {
+		/* stdout is the only buffered stream */
+		f = stdout;
+	}
+	if (f->f_len == 0) {
+		return 0;
+	}
+	result = __stdio_write(f, f->f_buf, f->f_len);
+	f->f_len = 0;
+	return result;
+}
+
+/*
+ * Append len bytes of data to f's buffer, writing it out when it is
+ * full or data ends a line. Returns 0, or EOF on error.
+ */
+int
+__stdio_send(FILE *f, const char *data, size_t len)
+{
+	size_t n, i;
+	int newline = 0;
+
+	for (i=0; i<len; i++) {
+		if (data[i] == '\n') {
+			newline = 1;
+			break;
+		}
+	}
+
+	/* a chunk at least as big as the buffer needn't be copied */
+	if (len >= BUFSIZ) {
+		if (fflush(f)) {
+			return EOF;
+		}
+		return __stdio_write(f, data, len);
+	}
+
+	while (len > 0) {
+		n = BUFSIZ - f->f_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(f->f_buf + f->f_len, data, n);
+		f->f_len += n;
+		data += n;
+		len -= n;
+		if (f->f_len == BUFSIZ && fflush(f)) {
+			return EOF;
+		}
+	}
+
+	if (newline) {
+		return fflush(f);
+	}
+	return 0;
+}
@@ -27,6 +27,7 @@
  * SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -42,6 +43,7 @@ exit(int code)
 	 * with atexit() before calling the syscall to actually exit.
 	 */
 
+	fflush(NULL);
 	_exit(code);
 }
 
@@ -30,10 +30,16 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator with boundary tags. Every block
+ * starts with a header giving its own size and the size of the block
+ * below it, so free() can find and merge both neighbours in constant
+ * time. Free blocks sit on one of NBINS lists: small blocks on exact
+ * size lists, larger ones on lists covering a power-of-two range.
+ * malloc() takes the first block from the smallest list that can
+ * hold the request, splitting off what it doesn't need, and only
+ * calls sbrk when every list comes up empty.
+ *
+ * See design/usermalloc.txt.
  */
 
 #include <stdlib.h>
@@ -54,91 +60,87 @@
 /*
  * malloc block header.
  *
- * mh_prevblock is the downwards offset to the previous header, 0 if this
+ * mh_prevsize is the size of the block just below this one, 0 if this
  * is the bottom of the heap.
  *
- * mh_nextblock is the upwards offset to the next header.
- *
- * mh_pad is unused.
- * mh_inuse is 1 if the block is in use, 0 if it is free.
- * mh_magic* should always be a fixed value.
+ * mh_size is the size of this block, header included, which is
+ * always a multiple of MBLOCKSIZE. The low bits hold the in-use flag
+ * and a fixed magic value for consistency checking.
  *
  * MBLOCKSIZE should equal sizeof(struct mheader) and be a power of 2.
  * MBLOCKSHIFT is the log base 2 of MBLOCKSIZE.
- * MMAGIC is the value for mh_magic*.
  */
 struct mheader {
+	size_t mh_prevsize;
+	size_t mh_size;
+};
 
 #if defined(MALLOC32)
 #define MBLOCKSIZE 8
 #define MBLOCKSHIFT 3
-#define MMAGIC 2
-	/*
-	 * 32-bit platform. size_t is 32 bits (4 bytes). 
-	 * Block size is 8 bytes.
-	 */
-	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:2;
-
-	unsigned mh_nextblock:29;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:2;
-
 #elif defined(MALLOC64)
 #define MBLOCKSIZE 16
 #define MBLOCKSHIFT 4
-#define MMAGIC 6
-	/*
-	 * 64-bit platform. size_t is 64 bits (8 bytes)
-	 * Block size is 16 bytes.
-	 */
-	unsigned mh_prevblock:62;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:3;
-
-	unsigned mh_nextblock:62;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:3;
-
 #else
 #error "please fix me"
 #endif
+
+#define M_INUSE		((size_t)1)
+#define M_MAGICMASK	((size_t)6)
+#define M_MAGIC		((size_t)4)
+
+/*
+ * A free block keeps its free list links where the data would go, so
+ * no block can be smaller than MMINBLOCK.
+ */
+struct mfree {
+	struct mheader mf_hdr;
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
 };
+#define MMINBLOCK	((sizeof(struct mfree) + MBLOCKSIZE - 1) & \
+			 ~(size_t)(MBLOCKSIZE-1))
 
 /*
  * Operator macros on struct mheader.
  *
- * M_NEXT/PREVOFF:	return offset to next/previous header
+ * M_SIZE:		return size of a block, header included
+ * M_INUSEP:		true if the block is allocated
  * M_NEXT/PREV:		return next/previous header
- * 
  * M_DATA:		return data pointer of a header
- * M_SIZE:		return data size of a header
- *
- * M_OK:		true if the magic values are correct
- * 
- * M_MKFIELD:		prepare a value for mh_next/prevblock.
- * 			(value should include the header size)
+ * M_OK:		true if the magic value is correct
+ * M_SET:		set size and in-use flag (and the magic)
  */
-
-#define M_NEXTOFF(mh)	((size_t)(((size_t)((mh)->mh_nextblock))<<MBLOCKSHIFT))
-#define M_PREVOFF(mh)	((size_t)(((size_t)((mh)->mh_prevblock))<<MBLOCKSHIFT))
-#define M_NEXT(mh)	((struct mheader *)(((char*)(mh))+M_NEXTOFF(mh)))
-#define M_PREV(mh)	((struct mheader *)(((char*)(mh))-M_PREVOFF(mh)))
-
+#define M_SIZE(mh)	((mh)->mh_size & ~(size_t)(MBLOCKSIZE-1))
+#define M_INUSEP(mh)	(((mh)->mh_size & M_INUSE) != 0)
+#define M_NEXT(mh)	((struct mheader *)(((char *)(mh)) + M_SIZE(mh)))
+#define M_PREV(mh)	((struct mheader *)(((char *)(mh)) - (mh)->mh_prevsize))
 #define M_DATA(mh)	((void *)((mh)+1))
-#define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+#define M_OK(mh)	(((mh)->mh_size & M_MAGICMASK) == M_MAGIC)
+#define M_SET(mh, sz, used) \
+	((mh)->mh_size = (sz) | M_MAGIC | ((used) ? M_INUSE : 0))
 
-#define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
+/*
+ * Free list bins. Blocks smaller than MSMALLMAX are kept on exact
+ * size lists, indexed by size/MBLOCKSIZE. Each bin after that holds
+ * a power of two range: [MSMALLMAX, 2*MSMALLMAX), and so on.
+ */
+#define MSMALLMAX	512
+#define NSMALLBINS	(MSMALLMAX / MBLOCKSIZE)
+#define NBINS		(NSMALLBINS + sizeof(size_t) * 8)
 
-#define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
+/* Grow the heap by at least this much at a time. */
+#define MSBRKMIN	4096
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * highest block in it, and the free lists.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__malloc_bins[NBINS];
 
 /*
  * Setup function.
@@ -215,33 +217,33 @@ __malloc_dump(void)
 {
 	struct mheader *mh;
 	uintptr_t i;
-	size_t rightprevblock;
+	size_t rightprevsize;
 
 	warnx("heap: ************************************************");
 
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+	rightprevsize = 0;
+	for (i=__heapbase; i<__heaptop; i += M_SIZE(mh)) {
 		mh = (struct mheader *) i;
 		if (!M_OK(mh)) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
 			     " has bad magic bits",
 			     (unsigned long) i);
 		}
-		if (mh->mh_prevblock != rightprevblock) {
+		if (mh->mh_prevsize != rightprevsize) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
 			     " has bad previous-block size %lu "
 			     "(should be %lu)",
 			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+			     (unsigned long) mh->mh_prevsize,
+			     (unsigned long) rightprevsize);
 		}
-		rightprevblock = mh->mh_nextblock;
+		rightprevsize = M_SIZE(mh);
 
 		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
 		      (unsigned long) i + MBLOCKSIZE,
-		      (unsigned long) M_SIZE(mh),
-		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		      (unsigned long) M_SIZE(mh) - MBLOCKSIZE,
+		      (unsigned long) (i+M_SIZE(mh)),
+		      M_INUSEP(mh) ? "INUSE" : "FREE");
 	}
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
@@ -250,48 +252,179 @@ __malloc_dump(void)
 	warnx("heap: ************************************************");
 }
 
+/*
+ * Clear a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
 #endif /* MALLOCDEBUG */
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and 
- * return a pointer to it.
+ * Free list handling.
  */
+
+/* the bin a free block of the given size belongs on */
 static
-void *
+unsigned
+__malloc_bin(size_t size)
+{
+	unsigned bin;
+
+	if (size < MSMALLMAX) {
+		return size >> MBLOCKSHIFT;
+	}
+	bin = NSMALLBINS;
+	for (size /= 2*MSMALLMAX; size > 0; size >>= 1) {
+		bin++;
+	}
+	return bin;
+}
+
+static
+void
+__malloc_link(struct mheader *mh)
+{
+	struct mfree *mf = (struct mfree *)mh;
+	unsigned bin = __malloc_bin(M_SIZE(mh));
+
+	mf->mf_prev = NULL;
+	mf->mf_next = __malloc_bins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__malloc_bins[bin] = mf;
+}
+
+static
+void
+__malloc_unlink(struct mheader *mh)
+{
+	struct mfree *mf = (struct mfree *)mh;
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		__malloc_bins[__malloc_bin(M_SIZE(mh))] = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
+/*
+ * Find a free block of at least size bytes and take it off its list.
+ * Returns NULL if there isn't one.
+ */
+static
+struct mheader *
+__malloc_findfree(size_t size)
+{
+	struct mfree *mf;
+	unsigned bin;
+
+	bin = __malloc_bin(size);
+	if (bin >= NSMALLBINS) {
+		/* range bin: the blocks in it may still be too small */
+		for (mf = __malloc_bins[bin]; mf != NULL; mf = mf->mf_next) {
+			if (M_SIZE(&mf->mf_hdr) >= size) {
+				__malloc_unlink(&mf->mf_hdr);
+				return &mf->mf_hdr;
+			}
+		}
+		bin++;
+	}
+	/* anything in a later bin is big enough */
+	for (; bin < NBINS; bin++) {
+		mf = __malloc_bins[bin];
+		if (mf != NULL) {
+			if (!M_OK(&mf->mf_hdr) || M_INUSEP(&mf->mf_hdr)) {
+				errx(1, "malloc: Heap corrupt; bad free block"
+				     " at %p", mf);
+			}
+			__malloc_unlink(&mf->mf_hdr);
+			return &mf->mf_hdr;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Get at least size more bytes at the top of the heap using sbrk,
+ * and return them as a block, merged with the free block already at
+ * the top if there is one. The block is not on any free list.
+ */
+static
+struct mheader *
 __malloc_sbrk(size_t size)
 {
+	struct mheader *mh;
+	size_t have, get;
 	void *x;
 
-	x = sbrk(size);
+	mh = __heaplast;
+	have = 0;
+	if (mh != NULL && !M_INUSEP(mh)) {
+		/* the top block is free; only ask for the difference */
+		have = M_SIZE(mh);
+		__malloc_unlink(mh);
+	}
+	get = size - have;
+	if (get < MSBRKMIN) {
+		get = MSBRKMIN;
+	}
+
+	x = sbrk(get);
 	if (x == (void *)-1) {
+		if (have > 0) {
+			__malloc_link(mh);
+		}
 		return NULL;
 	}
-
 	if ((uintptr_t)x != __heaptop) {
 		errx(1, "malloc: Internal error - "
 		     "heap top moved itself from 0x%lx to 0x%lx",
 		     (unsigned long) __heaptop,
 		     (unsigned long) (uintptr_t) x);
 	}
-	__heaptop += size;
-	return x;
+	__heaptop += get;
+
+	if (have == 0) {
+		/* a new block above the old top */
+		mh = x;
+		mh->mh_prevsize = __heaplast != NULL ? M_SIZE(__heaplast) : 0;
+		__heaplast = mh;
+	}
+	M_SET(mh, have + get, 0);
+	return mh;
 }
 
 /*
  * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * bytes (header included) in the current block. size must be a
+ * multiple of MBLOCKSIZE. The block must not be on a free list.
  *
- * Only split if the excess space is at least twice the blocksize -
- * one blocksize to hold a header and one for data.
+ * Only split if the excess space can hold a free block.
  */
 static
 void
 __malloc_split(struct mheader *mh, size_t size)
 {
-	struct mheader *mhnext, *mhnew;
+	struct mheader *mhnew;
 	size_t oldsize;
 
 	if (size % MBLOCKSIZE != 0) {
@@ -299,31 +432,24 @@ __malloc_split(struct mheader *mh, size_t size)
 		     (unsigned long) size);
 	}
 
-	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
+	oldsize = M_SIZE(mh);
+	if (oldsize - size < MMINBLOCK) {
 		/* no room */
 		return;
 	}
 
-	mhnext = M_NEXT(mh);
-
-	oldsize = M_SIZE(mh);
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-	
+	M_SET(mh, size, M_INUSEP(mh));
 	mhnew = M_NEXT(mh);
-	if (mhnew==mhnext) {
-		errx(1, "malloc: Internal error (split screwed up?)");
-	}
-
-	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
-	mhnew->mh_magic1 = MMAGIC;
-	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
-	mhnew->mh_inuse = 0;
-	mhnew->mh_magic2 = MMAGIC;
+	mhnew->mh_prevsize = size;
+	M_SET(mhnew, oldsize - size, 0);
 
-	if (mhnext != (struct mheader *) __heaptop) {
-		mhnext->mh_prevblock = mhnew->mh_nextblock;
+	if (mh == __heaplast) {
+		__heaplast = mhnew;
+	}
+	else {
+		M_NEXT(mhnew)->mh_prevsize = oldsize - size;
 	}
+	__malloc_link(mhnew);
 }
 
 /*
@@ -333,8 +459,6 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -351,74 +475,26 @@ malloc(size_t size)
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
+	/* Add the header and round up to an integral number of blocks. */
+	if (size > (size_t)-1 - 2*MBLOCKSIZE) {
+		return NULL;
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	size = ((size + 2*MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size < MMINBLOCK) {
+		size = MMINBLOCK;
 	}
 
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	mh = __malloc_findfree(size);
 	if (mh == NULL) {
-		return NULL;
+		/* Didn't find anything. Expand the heap. */
+		mh = __malloc_sbrk(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
-	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	__malloc_split(mh, size);
+	M_SET(mh, M_SIZE(mh), 1);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -429,52 +505,6 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
-/*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
- */
-static
-void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
-	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
-{
-	struct mheader *mhnextnext;
-
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
-	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
-
-	mhnextnext = M_NEXT(mhnext);
-
-	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
-				     MBLOCKSIZE + M_SIZE(mhnext));
-
-	if (mhnextnext != (struct mheader *)__heaptop) {
-		mhnextnext->mh_prevblock = mh->mh_nextblock;
-	}
-
-	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
-}
-
 /*
  * The actual free() implementation.
  */
@@ -482,6 +512,7 @@ void
 free(void *x)
 {
 	struct mheader *mh, *mhnext, *mhprev;
+	size_t size;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -510,27 +541,56 @@ free(void *x)
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
 
-	if (!mh->mh_inuse) {
+	if (!M_INUSEP(mh)) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
+#ifdef MALLOCDEBUG
 	/* wipe it */
-	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh) - MBLOCKSIZE);
+#endif
+
+	/* mark it free */
+	size = M_SIZE(mh);
 
 	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mh != __heaplast) {
+		mhnext = M_NEXT(mh);
+		if (mhnext->mh_prevsize != size || !M_OK(mhnext)) {
+			errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+			     mh, mhnext);
+		}
+		if (!M_INUSEP(mhnext)) {
+			__malloc_unlink(mhnext);
+			size += M_SIZE(mhnext);
+			if (mhnext == __heaplast) {
+				__heaplast = mh;
+			}
+		}
 	}
 
 	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
+	if (mh->mh_prevsize != 0) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (M_SIZE(mhprev) != mh->mh_prevsize || !M_OK(mhprev)) {
+			errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+			     mhprev, mh);
+		}
+		if (!M_INUSEP(mhprev)) {
+			__malloc_unlink(mhprev);
+			size += M_SIZE(mhprev);
+			if (mh == __heaplast) {
+				__heaplast = mhprev;
+			}
+			mh = mhprev;
+		}
+	}
+
+	M_SET(mh, size, 0);
+	if (mh != __heaplast) {
+		M_NEXT(mh)->mh_prevsize = size;
 	}
+	__malloc_link(mh);
 
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
@@ -20,6 +20,10 @@ awk '
 	print $2, $3;
     }
 ' | awk '{
+	# libc wraps fork (see unix/fork.c); its stub is __fork.
+	if ($1 == "fork") {
+		$1 = "__fork";
+	}
 	# output something simple that will work in syscalls.S.
 	printf "SYSCALL(%s, %s)\n", $1, $2;
 }'
@@ -95,12 +95,40 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under an indirect block of the given
+ * level (1 for single indirect, 2 double, 3 triple).
+ */
+static
+uint32_t
+dodirindirect(uint32_t iblock, int level)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block, nblocks=0;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (level > 1) {
+			nblocks += dodirindirect(block, level-1);
+		}
+		else {
+			dodirblock(block);
+			nblocks++;
+		}
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -120,14 +148,13 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		nblocks += dodirindirect(SWAPL(sfi.sfi_indirect), 1);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		nblocks += dodirindirect(SWAPL(sfi.sfi_dindirect), 2);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		nblocks += dodirindirect(SWAPL(sfi.sfi_tindirect), 3);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mallocbench.c
+ *
+ * Measures malloc/free throughput. Three workloads:
+ *
+ *    1. churn: allocate and free the same small size over and over.
+ *    2. mixed: random sizes, mostly small, with a live set of
+ *       NSLOTS blocks; each step frees or allocates one slot.
+ *    3. grow: allocate many blocks, then free them all.
+ *
+ * Prints operations per second for each. Takes an optional
+ * iteration count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_ITERS	100000
+#define NSLOTS		1024
+
+static void *slots[NSLOTS];
+
+/* current time in milliseconds */
+static
+unsigned long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+report(const char *name, unsigned long ops, unsigned long start)
+{
+	unsigned long ms;
+
+	ms = now() - start;
+	if (ms == 0) {
+		ms = 1;
+	}
+	printf("%-6s %8lu ops in %6lu ms: %8lu ops/sec\n", name, ops, ms,
+	       (unsigned long)((unsigned long long)ops * 1000 / ms));
+}
+
+static
+void
+churn(unsigned long iters)
+{
+	unsigned long i, start;
+	void *p;
+
+	start = now();
+	for (i=0; i<iters; i++) {
+		p = malloc(48);
+		if (p == NULL) {
+			errx(1, "churn: malloc failed at %lu", i);
+		}
+		free(p);
+	}
+	report("churn", 2*iters, start);
+}
+
+static
+size_t
+pick_size(void)
+{
+	/* mostly small objects, with the odd large one */
+	if (random() % 16 == 0) {
+		return 512 + random() % 8192;
+	}
+	return 8 + random() % 248;
+}
+
+static
+void
+mixed(unsigned long iters)
+{
+	unsigned long i, start;
+	unsigned n;
+	size_t size;
+
+	srandom(0);
+	start = now();
+	for (i=0; i<iters; i++) {
+		n = random() % NSLOTS;
+		if (slots[n] != NULL) {
+			free(slots[n]);
+			slots[n] = NULL;
+			continue;
+		}
+		size = pick_size();
+		slots[n] = malloc(size);
+		if (slots[n] == NULL) {
+			errx(1, "mixed: malloc of %lu failed at %lu",
+			     (unsigned long)size, i);
+		}
+		/* touch it, so the pages are really there */
+		memset(slots[n], n, size);
+	}
+	report("mixed", iters, start);
+
+	for (n=0; n<NSLOTS; n++) {
+		free(slots[n]);
+		slots[n] = NULL;
+	}
+}
+
+static
+void
+grow(unsigned long iters)
+{
+	unsigned long i, done, start;
+	unsigned n;
+
+	start = now();
+	done = 0;
+	for (i=0; i<iters; i += NSLOTS) {
+		for (n=0; n<NSLOTS; n++) {
+			slots[n] = malloc(16 + n % 64);
+			if (slots[n] == NULL) {
+				errx(1, "grow: malloc failed");
+			}
+		}
+		for (n=0; n<NSLOTS; n++) {
+			free(slots[NSLOTS - 1 - n]);
+			slots[NSLOTS - 1 - n] = NULL;
+		}
+		done += 2*NSLOTS;
+	}
+	report("grow", done, start);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long iters = DEFAULT_ITERS;
+
+	if (argc > 1) {
+		iters = atoi(argv[1]);
+		if (iters == 0) {
+			errx(1, "Usage: mallocbench [iterations]");
+		}
+	}
+
+	churn(iters);
+	mixed(iters);
+	grow(iters);
+	printf("mallocbench: done\n");
+	return 0;
+}